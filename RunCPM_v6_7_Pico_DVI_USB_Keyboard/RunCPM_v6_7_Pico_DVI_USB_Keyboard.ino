@@ -83,11 +83,6 @@ uint32 port_b_pup = 0x00; // no pull-up
 
 #include "abstraction_arduino.h"
 
-// =========================================================================================
-// Serial port speed
-// =========================================================================================
-#define SERIALSPD 115200
-
 // =========================================================================================
 // PUN: device configuration
 // =========================================================================================
@@ -155,7 +150,10 @@ void setup(void) {
   }
 
 
-  Serial1.begin(SERIALSPD);
+  Serial1.begin(SERIALSPD);  // SERIALSPD is set in globals.h
+#ifdef SERIAL_RXRING
+  _rx_begin();
+#endif
 #if defined(WAIT_SERIAL)
   while (!Serial1) {    // Wait until serial1 is connected
     digitalWrite(LED, HIGH^LEDinv);
@@ -57,61 +57,453 @@ typedef struct {
 
 static DirFat_t fileDirEntry;
 
+/* Directory index, keeps the file list of the most used user folders in memory */
+/*===============================================================================*/
+#define DIRIDX_SLOTS 4		// Number of user folders indexed at once
+#define DIRIDX_GROW 64		// Number of entries added each time an index grows
+#define DIRIDX_MAX 512		// Folders with more files than this are searched directly on the card
+
+typedef struct {
+	uint8 name[11];		// File name in FCB format
+	uint8 attrib;		// FAT attributes
+	uint32 size;		// File size in bytes
+} DIRIDX_ENTRY;
+
+typedef struct {
+	uint8 drive;		// Drive folder letter, 0 if the slot is free
+	uint8 user;			// User folder character
+	uint16 count;		// Number of entries in use
+	uint16 alloc;		// Number of entries allocated
+	uint32 used;		// Last time this slot was used, for replacement
+	DIRIDX_ENTRY* entry;
+} DIRIDX;
+
+static DIRIDX dirIndex[DIRIDX_SLOTS];
+static uint32 dirIndexTime = 0;
+static DIRIDX* findIndex = NULL;	// Index being searched, NULL if searching the card
+static uint16 findPos;				// Next entry to be checked on findIndex
+
+// Converts a host file name onto FCB name format, fails if it isn't a valid 8.3 name
+bool _sys_dirfcbname(char* from, uint8* to) {
+	uint8 i = 0;
+
+	while (*from && *from != '.') {
+		if (i == 8)
+			return(false);
+		to[i++] = toupper(*from++);
+	}
+	while (i < 8)
+		to[i++] = ' ';
+	if (*from == '.')
+		++from;
+	while (*from) {
+		if (i == 11)
+			return(false);
+		to[i++] = toupper(*from++);
+	}
+	while (i < 11)
+		to[i++] = ' ';
+	return(true);
+}
+
+// Returns the index of a drive/user folder, reading the folder into it if needed
+DIRIDX* _sys_dirindex(uint8 drive, uint8 user) {
+	uint8 path[4] = { drive, FOLDERCHAR, user, 0 };
+	char name[16];
+	DIRIDX* d = NULL;
+	DIRIDX_ENTRY* e;
+	File32 dir, f;
+	size_t len;
+	uint8 i;
+
+	for (i = 0; i < DIRIDX_SLOTS; ++i) {
+		if (dirIndex[i].drive == drive && dirIndex[i].user == user) {
+			dirIndex[i].used = ++dirIndexTime;
+			return(&dirIndex[i]);
+		}
+		if (&dirIndex[i] != findIndex && (!d || dirIndex[i].used < d->used))	// A search may still be going through findIndex
+			d = &dirIndex[i];
+	}
+
+	d->drive = 0;
+	d->used = 0;
+	d->count = 0;
+	if (!(dir = SD.open((char*)path)))
+		return(NULL);
+	while ((f = dir.openNextFile())) {
+		if (d->count == d->alloc) {
+			e = NULL;
+			if (d->alloc < DIRIDX_MAX)
+				e = (DIRIDX_ENTRY*)realloc(d->entry, (d->alloc + DIRIDX_GROW) * sizeof(DIRIDX_ENTRY));
+			if (!e) {	// Too many files, the folder will be searched on the card
+				f.close();
+				dir.close();
+				free(d->entry);
+				d->entry = NULL;
+				d->alloc = 0;
+				d->count = 0;
+				return(NULL);
+			}
+			d->entry = e;
+			d->alloc += DIRIDX_GROW;
+		}
+		e = &d->entry[d->count];
+		len = f.getName(name, sizeof(name));
+		if (!f.isDirectory() && len && len <= 12 && _sys_dirfcbname(name, e->name)) {
+			e->attrib = f.attrib();
+			e->size = f.size();
+			++d->count;
+		}
+		f.close();
+	}
+	dir.close();
+	d->drive = drive;
+	d->user = user;
+	d->used = ++dirIndexTime;
+	return(d);
+}
+
+// Looks a file up on the index of its folder without reading the card, NULL if it is not there
+DIRIDX_ENTRY* _sys_dirlookup(uint8* filename) {
+	uint8 name[11];
+	uint16 j;
+	uint8 i;
+
+	if (filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR)
+		return(NULL);
+	for (i = 0; i < DIRIDX_SLOTS; ++i) {
+		if (dirIndex[i].drive == filename[0] && dirIndex[i].user == filename[2]) {
+			if (!_sys_dirfcbname((char*)&filename[4], name))
+				return(NULL);
+			for (j = 0; j < dirIndex[i].count; ++j) {
+				if (!memcmp(dirIndex[i].entry[j].name, name, 11))
+					return(&dirIndex[i].entry[j]);
+			}
+			return(NULL);
+		}
+	}
+	return(NULL);
+}
+
+// Drops the index of the folder holding filename, as its contents changed
+// A search going through it goes on with the entries it had, the slot is not reused until the search ends
+void _sys_dirchanged(uint8* filename) {
+	uint8 i;
+
+	if (filename[1] != FOLDERCHAR)
+		return;
+	for (i = 0; i < DIRIDX_SLOTS; ++i) {
+		if (dirIndex[i].drive == filename[0] && dirIndex[i].user == filename[2]) {
+			dirIndex[i].drive = 0;
+			dirIndex[i].used = 0;
+		}
+	}
+}
+
+#ifdef RAMDISK
+#include "ramdisk.h"
+#endif
+#ifdef ROMDISK
+#include "romdisk.h"
+#endif
+#ifdef DISKIMAGE
+#include "diskimage.h"
+#endif
+
+/* Folder handles, keeps the most used user folders open so paths are not walked from the root */
+/*===============================================================================*/
+#define DIRHDL_SLOTS 4		// Number of user folders kept open at once
+
+typedef struct {
+	uint8 drive;		// Drive folder letter, 0 if the slot is free
+	uint8 user;			// User folder character
+	uint32 used;		// Last time this slot was used, for replacement
+	File32 dir;
+} DIRHDL;
+
+static DIRHDL dirHandle[DIRHDL_SLOTS];
+static uint32 dirHandleTime = 0;
+
+// Returns the open user folder of a "X/U/NAME" path, or NULL if the path has to be opened from the root
+File32* _sys_dirhandle(uint8* filename) {
+	uint8 path[4] = { filename[0], FOLDERCHAR, filename[2], 0 };
+	DIRHDL* d = &dirHandle[0];
+	uint8 i;
+
+	if (filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR || !filename[4])
+		return(NULL);
+	for (i = 0; i < DIRHDL_SLOTS; ++i) {
+		if (dirHandle[i].drive == filename[0] && dirHandle[i].user == filename[2]) {
+			dirHandle[i].used = ++dirHandleTime;
+			return(&dirHandle[i].dir);
+		}
+		if (dirHandle[i].used < d->used)
+			d = &dirHandle[i];
+	}
+
+	if (d->drive)
+		d->dir.close();
+	d->drive = 0;
+	d->used = 0;
+	if (!(d->dir = SD.open((char*)path)))
+		return(NULL);
+	if (!d->dir.isDirectory()) {
+		d->dir.close();
+		return(NULL);
+	}
+	d->drive = filename[0];
+	d->user = filename[2];
+	d->used = ++dirHandleTime;
+	return(&d->dir);
+}
+
+// Opens a file, relative to its user folder if that is kept open
+File32 _sys_open(uint8* filename, oflag_t flags) {
+	File32 f;
+	File32* dir = _sys_dirhandle(filename);
+
+	if (dir)
+		f.open(dir, (char*)&filename[4], flags);
+	else
+		f = SD.open((char*)filename, flags);
+	return(f);
+}
+
+#ifdef WRITEBEHIND
+#include "writebehind.h"
+#endif
+
+#ifdef SERIAL_TXRING
+#include "serialtx.h"
+#endif
+
+#ifdef SERIAL_RXRING
+#include "serialrx.h"
+#endif
+
+/* Drive and user folder cache, remembers which folders were found on the card */
+/*===============================================================================*/
+static uint16 checkedDrives = 0;	// Drives whose folder was already looked up
+static uint16 knownDrives = 0;		// Drives whose folder exists
+static uint32 knownUsers[16];		// User folders known to exist, one bit per user on each drive
+
+// Drops the indexes, folder handles and cached folder checks of the drives in vector, so they are read again from the card
+void _sys_diskreset(uint16 vector) {
+	uint8 i;
+
+#ifdef WRITEBEHIND
+	_wb_drain();
+#endif
+	for (i = 0; i < DIRIDX_SLOTS; ++i) {
+		if (dirIndex[i].drive && (vector & (1 << (dirIndex[i].drive - 'A')))) {
+			dirIndex[i].drive = 0;
+			dirIndex[i].used = 0;
+		}
+	}
+	findIndex = NULL;
+	for (i = 0; i < DIRHDL_SLOTS; ++i) {
+		if (dirHandle[i].drive && (vector & (1 << (dirHandle[i].drive - 'A')))) {
+			dirHandle[i].dir.close();
+			dirHandle[i].drive = 0;
+			dirHandle[i].used = 0;
+		}
+	}
+	checkedDrives &= ~vector;
+	for (i = 0; i < 16; ++i) {
+		if (vector & (1 << i))
+			knownUsers[i] = 0;
+	}
+}
+
 bool _sys_exists(uint8* filename) {
+	File32* dir;
+
+#ifdef RAMDISK
+	if (_rd_isram(filename))	// Every user folder exists on the RAM drive
+		return(filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR || !filename[4] || _rd_find(filename));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR || !filename[4] || _ro_find(filename));
+#endif
+	dir = _sys_dirhandle(filename);
+
+	if (dir)
+		return(dir->exists((char*)&filename[4]));
 	return(SD.exists((const char *)filename));
 }
 
 File32 _sys_fopen_w(uint8* filename) {
-	return(SD.open((char*)filename, O_CREAT | O_WRITE));
+	_sys_dirchanged(filename);
+	return(_sys_open(filename, O_CREAT | O_WRITE));
+}
+
+#if defined USE_PUN || defined USE_LST
+/* Output buffers of the PUN: and LST: device files */
+/*===============================================================================*/
+// Bytes are written to the file when the buffer fills up, when the device has been idle for DEVBUF_DELAY ms,
+// on warm boot and before the file is closed
+#define DEVBUF_SLOTS 2			// Device files buffered
+#define DEVBUF_SIZE 512			// Bytes buffered for each file
+#define DEVBUF_DELAY 1000		// Milliseconds of idle time before the bytes are written
+
+typedef struct {
+	File32* f;			// File the bytes go to, NULL if the slot is free
+	uint8* name;		// Its name, to drop the index of its folder when it grows
+	uint16 len;			// Bytes on the buffer
+	uint32 last;		// millis() of the last byte put
+	uint8 data[DEVBUF_SIZE];
+} DEVBUF;
+
+static DEVBUF devBuf[DEVBUF_SLOTS];
+
+// Writes out what is on a buffer
+void _sys_devwrite(DEVBUF* b) {
+	if (b->len) {
+		digitalWrite(LED, HIGH ^ LEDinv);
+		b->f->write(b->data, b->len);
+		digitalWrite(LED, LOW ^ LEDinv);
+		b->len = 0;
+		_sys_dirchanged(b->name);
+	}
 }
 
-int _sys_fputc(uint8 ch, File32& f) {
-	return(f.write(ch));
+int _sys_fputc(uint8 ch, File32& f, uint8* filename) {
+	DEVBUF* b = NULL;
+	uint8 i;
+
+	for (i = 0; i < DEVBUF_SLOTS; ++i) {
+		if (devBuf[i].f == &f) {
+			b = &devBuf[i];
+			break;
+		}
+		if (!b && !devBuf[i].f)
+			b = &devBuf[i];
+	}
+	if (!b) {					// No free buffer
+		_sys_dirchanged(filename);
+		return(f.write(ch));
+	}
+	b->f = &f;
+	b->name = filename;
+	if (b->len == DEVBUF_SIZE)
+		_sys_devwrite(b);
+	b->data[b->len++] = ch;
+	b->last = millis();
+	return(1);
 }
 
 void _sys_fflush(File32& f) {
+	uint8 i;
+
+	for (i = 0; i < DEVBUF_SLOTS; ++i) {
+		if (devBuf[i].f == &f)
+			_sys_devwrite(&devBuf[i]);
+	}
 	f.flush();
 }
 
 void _sys_fclose(File32& f) {
+	uint8 i;
+
+	for (i = 0; i < DEVBUF_SLOTS; ++i) {
+		if (devBuf[i].f == &f) {
+			_sys_devwrite(&devBuf[i]);
+			devBuf[i].f = NULL;
+		}
+	}
 	f.close();
 }
 
+// Writes out and flushes the device files that have been idle for a while, or all of them (all)
+void _sys_devidle(bool all) {
+	uint8 i;
+
+	for (i = 0; i < DEVBUF_SLOTS; ++i) {
+		if (devBuf[i].f && devBuf[i].len && (all || millis() - devBuf[i].last >= DEVBUF_DELAY))
+			_sys_fflush(*devBuf[i].f);
+	}
+}
+#endif
+
 int _sys_select(uint8* disk) {
 	uint8 result = FALSE;
+	uint8 drive = disk[0] - 'A';
 	File32 f;
 
+#ifdef RAMDISK
+	if (_rd_isram(disk))
+		return(TRUE);
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(disk)) {
+		roVector |= 1 << (ROMDISK - 'A');	// The ROM drive is always read only
+		return(_ro_ready() ? TRUE : FALSE);
+	}
+#endif
+	if (drive < 16 && (checkedDrives & (1 << drive)))
+		return((knownDrives & (1 << drive)) ? TRUE : FALSE);
 	digitalWrite(LED, HIGH ^ LEDinv);
 	if ((f = SD.open((char*)disk, O_READ))) {
 		if (f.isDirectory())
 			result = TRUE;
 		f.close();
 	}
-	digitalWrite(LED, LOW ^ LEDinv);
-	return(result);
-}
-
-long _sys_filesize(uint8* filename) {
-	long l = -1;
-	File32 f;
-
-	digitalWrite(LED, HIGH ^ LEDinv);
-	if ((f = SD.open((char*)filename, O_RDONLY))) {
-		l = f.size();
-		f.close();
+	if (drive < 16) {
+		checkedDrives |= 1 << drive;
+		if (result)
+			knownDrives |= 1 << drive;
+		else
+			knownDrives &= ~(1 << drive);
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
-	return(l);
+	return(result);
 }
 
-int _sys_openfile(uint8* filename) {
+// Checks that a file exists, returning its size and keeping its attributes on fileDirEntry
+// Answers from the folder index when there is one, otherwise opens the file once
+int _sys_openfile(uint8* filename, long* size) {
 	File32 f;
 	int result = 0;
-
+	DIRIDX_ENTRY* e;
+
+#ifdef RAMDISK
+	if (_rd_isram(filename)) {
+		RD_FILE* r = _rd_find(filename);
+		if (r) {
+			memcpy(fileDirEntry.name, r->name, 11);
+			fileDirEntry.attributes = 0;
+			*size = r->size;
+		}
+		return(r ? 1 : 0);
+	}
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename)) {
+		RO_FILE* o = _ro_find(filename);
+		if (o) {
+			memcpy(fileDirEntry.name, o->name, 11);
+			fileDirEntry.attributes = 0x01;	// Read only
+			*size = o->size;
+		}
+		return(o ? 1 : 0);
+	}
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, false);
+#endif
+	e = _sys_dirlookup(filename);
+	if (e) {	// A name missing from the index is still looked for on the card
+		memcpy(fileDirEntry.name, e->name, 11);
+		fileDirEntry.attributes = e->attrib;
+		*size = e->size;
+		return(1);
+	}
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_READ);
+	f = _sys_open(filename, O_READ);
 	if (f) {
 		f.dirEntry(&fileDirEntry);
+		*size = f.size();
 		f.close();
 		result = 1;
 	}
@@ -119,14 +511,34 @@ int _sys_openfile(uint8* filename) {
 	return(result);
 }
 
+long _sys_filesize(uint8* filename) {
+	long l = -1;
+
+	if (!_sys_openfile(filename, &l))
+		l = -1;
+	return(l);
+}
+
 int _sys_makefile(uint8* filename) {
 	File32 f;
 	int result = 0;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_makefile(filename));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(0);
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, true);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_CREAT | O_WRITE);
+	f = _sys_open(filename, O_CREAT | O_WRITE);
 	if (f) {
 		f.close();
+		_sys_dirchanged(filename);
 		result = 1;
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
@@ -134,20 +546,55 @@ int _sys_makefile(uint8* filename) {
 }
 
 int _sys_deletefile(uint8* filename) {
+	File32* dir;
+	int result;
+
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_deletefile(filename));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(0);
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, true);
+#endif
+	dir = _sys_dirhandle(filename);
 	digitalWrite(LED, HIGH ^ LEDinv);
-	return(SD.remove((char*)filename));
+	_sys_dirchanged(filename);
+	if (dir)
+		result = dir->remove((char*)&filename[4]);
+	else
+		result = SD.remove((char*)filename);
 	digitalWrite(LED, LOW ^ LEDinv);
+	return(result);
 }
 
 int _sys_renamefile(uint8* filename, uint8* newname) {
 	File32 f;
+	File32* dir;
 	int result = 0;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_renamefile(filename, newname));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(0);
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, true);
+	_wb_barrier(newname, true);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_WRITE | O_APPEND);
+	f = _sys_open(filename, O_WRITE | O_APPEND);
 	if (f) {
-    if (f.rename((char*)newname)) {
+		dir = _sys_dirhandle(newname);
+		if (dir ? f.rename(dir, (char*)&newname[4]) : f.rename((char*)newname)) {
 			f.close();
+			_sys_dirchanged(filename);
 			result = 1;
 		}
 	}
@@ -180,7 +627,7 @@ bool _sys_extendfile(char* fn, unsigned long fpos)
 	unsigned long i;
 
 	digitalWrite(LED, HIGH ^ LEDinv);
-	if ((f = SD.open(fn, O_WRITE | O_APPEND))) {
+	if ((f = _sys_open((uint8*)fn, O_WRITE | O_APPEND))) {
 		if (fpos > f.size()) {
 			for (i = 0; i < f.size() - fpos; ++i) {
 				if (f.write((uint8)0) != 1) {
@@ -197,79 +644,170 @@ bool _sys_extendfile(char* fn, unsigned long fpos)
 	return(result);
 }
 
-uint8 _sys_readseq(uint8* filename, long fpos) {
+// Reads up to *recs records into the DMA buffer in a single host read, padding the last one with ^Z
+// Sets *recs to the number of records read and returns 0x00 if all of them were read, 0x01 otherwise
+uint8 _sys_readrecs(File32& f, uint8* recs) {
+	uint16 count = *recs;
+	int bytesread;
+	uint16 i;
+
+	*recs = 0;
+	bytesread = f.read(_RamSysAddr(dmaAddr), count * BlkSZ);
+	if (bytesread > 0) {
+		*recs = (bytesread + BlkSZ - 1) / BlkSZ;
+		for (i = bytesread; i < *recs * BlkSZ; ++i)
+			_RamWrite(dmaAddr + i, 0x1a);
+	}
+	return(*recs == count ? 0x00 : 0x01);
+}
+
+// Writes *recs records from the DMA buffer in a single host write
+// Sets *recs to the number of records written and returns 0x00 if all of them were written,
+// 0x02 (disk full) if only some were and 0xff if none was
+uint8 _sys_writerecs(File32& f, uint8* recs) {
+	uint16 count = *recs;
+	size_t written;
+
+	written = f.write(_RamSysAddr(dmaAddr), count * BlkSZ);
+	*recs = written / BlkSZ;	// A record cut short by the card is not counted
+	if (*recs == count)
+		return(0x00);
+	return(*recs ? 0x02 : 0xff);
+}
+
+uint8 _sys_readseq(uint8* filename, long fpos, uint8* recs) {
 	uint8 result = 0xff;
 	File32 f;
-	uint8 bytesread;
-	uint8 dmabuf[BlkSZ];
-	uint8 i;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_readseq(filename, fpos, recs));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(_ro_readseq(filename, fpos, recs));
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, false);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_READ);
+	f = _sys_open(filename, O_READ);
 	if (f) {
 		if (f.seek(fpos)) {
-			for (i = 0; i < BlkSZ; ++i)
-				dmabuf[i] = 0x1a;
-			bytesread = f.read(&dmabuf[0], BlkSZ);
-			if (bytesread) {
-				for (i = 0; i < BlkSZ; ++i)
-					_RamWrite(dmaAddr + i, dmabuf[i]);
-			}
-			result = bytesread ? 0x00 : 0x01;
+			result = _sys_readrecs(f, recs);
 		} else {
+			*recs = 0;
 			result = 0x01;
 		}
 		f.close();
 	} else {
+		*recs = 0;
 		result = 0x10;
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
 	return(result);
 }
 
-uint8 _sys_writeseq(uint8* filename, long fpos) {
+// Reads whole records from fpos straight into RAM at address, stopping before limit
+// The last record is padded with ^Z, as _sys_readseq does. Returns the number of records read
+uint16 _sys_loadfile(uint8* filename, long fpos, uint16 address, uint16 limit) {
+	File32 f;
+	uint16 recs = 0;
+	int bytesread = 0;
+	uint16 pad;
+
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_loadfile(filename, fpos, address, limit));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(_ro_loadfile(filename, fpos, address, limit));
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, false);
+#endif
+	digitalWrite(LED, HIGH ^ LEDinv);
+	f = _sys_open(filename, O_READ);
+	if (f) {
+		if (f.seek(fpos) && address < limit)
+			bytesread = f.read(_RamSysAddr(address), limit - address);
+		if (bytesread > 0) {
+			recs = (bytesread + BlkSZ - 1) / BlkSZ;
+			for (pad = bytesread; pad < recs * BlkSZ; ++pad)
+				_RamWrite(address + pad, 0x1a);
+		}
+		f.close();
+	}
+	digitalWrite(LED, LOW ^ LEDinv);
+	return(recs);
+}
+
+uint8 _sys_writeseq(uint8* filename, long fpos, uint8* recs) {
 	uint8 result = 0xff;
 	File32 f;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_write(filename, fpos, recs));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename)) {
+		*recs = 0;
+		return(0xff);
+	}
+#endif
+#ifdef WRITEBEHIND
+	if (_wb_write(filename, fpos, recs))
+		return(0x00);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
 	if (_sys_extendfile((char*)filename, fpos))
-		f = SD.open((char*)filename, O_RDWR);
+		f = _sys_open(filename, O_RDWR);
 	if (f) {
 		if (f.seek(fpos)) {
-			if (f.write(_RamSysAddr(dmaAddr), BlkSZ))
-				result = 0x00;
+			result = _sys_writerecs(f, recs);
+			_sys_dirchanged(filename);
+#ifdef WRITEBEHIND
+			if (!result)
+				_wb_written(filename);
+#endif
 		} else {
+			*recs = 0;
 			result = 0x01;
 		}
 		f.close();
 	} else {
+		*recs = 0;
 		result = 0x10;
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
 	return(result);
 }
 
-uint8 _sys_readrand(uint8* filename, long fpos) {
+uint8 _sys_readrand(uint8* filename, long fpos, uint8* recs) {
 	uint8 result = 0xff;
 	File32 f;
-	uint8 bytesread;
-	uint8 dmabuf[BlkSZ];
-	uint8 i;
 	long extSize;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_readrand(filename, fpos, recs));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename))
+		return(_ro_readrand(filename, fpos, recs));
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier(filename, false);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_READ);
+	f = _sys_open(filename, O_READ);
 	if (f) {
 		if (f.seek(fpos)) {
-			for (i = 0; i < BlkSZ; ++i)
-				dmabuf[i] = 0x1a;
-			bytesread = f.read(&dmabuf[0], BlkSZ);
-			if (bytesread) {
-				for (i = 0; i < BlkSZ; ++i)
-					_RamWrite(dmaAddr + i, dmabuf[i]);
-			}
-			result = bytesread ? 0x00 : 0x01;
+			result = _sys_readrecs(f, recs);
 		} else {
+			*recs = 0;
 			if (fpos >= 65536L * BlkSZ) {
 				result = 0x06;	// seek past 8MB (largest file size in CP/M)
 			} else {
@@ -284,35 +822,135 @@ uint8 _sys_readrand(uint8* filename, long fpos) {
 		}
 		f.close();
 	} else {
+		*recs = 0;
 		result = 0x10;
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
 	return(result);
 }
 
-uint8 _sys_writerand(uint8* filename, long fpos) {
+uint8 _sys_writerand(uint8* filename, long fpos, uint8* recs) {
 	uint8 result = 0xff;
 	File32 f;
 
+#ifdef RAMDISK
+	if (_rd_isram(filename))
+		return(_rd_write(filename, fpos, recs));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(filename)) {
+		*recs = 0;
+		return(0xff);
+	}
+#endif
+#ifdef WRITEBEHIND
+	if (_wb_write(filename, fpos, recs))
+		return(0x00);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
 	if (_sys_extendfile((char*)filename, fpos)) {
-		f = SD.open((char*)filename, O_RDWR);
+		f = _sys_open(filename, O_RDWR);
 	}
 	if (f) {
 		if (f.seek(fpos)) {
-			if (f.write(_RamSysAddr(dmaAddr), BlkSZ))
-				result = 0x00;
+			result = _sys_writerecs(f, recs);
+			_sys_dirchanged(filename);
+#ifdef WRITEBEHIND
+			if (!result)
+				_wb_written(filename);
+#endif
 		} else {
+			*recs = 0;
 			result = 0x06;
 		}
 		f.close();
 	} else {
+		*recs = 0;
 		result = 0x10;
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
 	return(result);
 }
 
+// Copies a file using RAM from address up to limit as buffer, then reads both files back and compares them if verify is set
+// Files on the card are copied byte for byte in chunks as big as the buffer, so the copy keeps the exact host size
+// Files on the RAM or ROM drives go whole record at a time, the last record padded with ^Z as a record read would be
+// Returns 0 if done, 1 if the source could not be read, 2 if the destination could not be written, 3 if they differ
+uint8 _sys_copyfile(uint8* from, uint8* to, uint16 address, uint16 limit, bool verify) {
+	File32 src, dst;
+	uint8 result = 0;
+	uint16 half = ((limit - address) / 2) & ~(BlkSZ - 1);
+	uint16 size = (limit - address) & ~(BlkSZ - 1);
+	uint16 recs, dma = dmaAddr;
+	uint8 n;
+	long fpos = 0;
+	int bytesread;
+	bool card = TRUE;
+
+#ifdef RAMDISK
+	card = card && !_rd_isram(from) && !_rd_isram(to);
+#endif
+#ifdef ROMDISK
+	card = card && !_ro_isrom(from) && !_ro_isrom(to);
+#endif
+	if (card) {
+#ifdef WRITEBEHIND
+		_wb_barrier(from, false);
+		_wb_barrier(to, true);
+#endif
+		digitalWrite(LED, HIGH ^ LEDinv);
+		if (!(src = _sys_open(from, O_READ))) {
+			result = 1;
+		} else {
+			_sys_dirchanged(to);
+			if (!(dst = _sys_open(to, O_CREAT | O_WRITE | O_TRUNC))) {
+				result = 2;
+			} else {
+				while ((bytesread = src.read(_RamSysAddr(address), size)) > 0) {
+					if (dst.write(_RamSysAddr(address), bytesread) != (size_t)bytesread) {
+						result = 2;
+						break;
+					}
+				}
+				if (bytesread < 0)
+					result = 1;
+				dst.close();
+			}
+			src.close();
+		}
+		digitalWrite(LED, LOW ^ LEDinv);
+	} else {
+		if (size > 255 * BlkSZ)		// Largest write _sys_writeseq takes
+			size = 255 * BlkSZ;
+		if (!_sys_exists(from))
+			return(1);
+		_sys_deletefile(to);
+		if (!_sys_makefile(to))
+			return(2);
+		dmaAddr = address;
+		while ((recs = _sys_loadfile(from, fpos, address, address + size))) {
+			n = recs;
+			if (_sys_writeseq(to, fpos, &n) || n != recs) {
+				result = 2;
+				break;
+			}
+			fpos += (long)recs * BlkSZ;
+		}
+		dmaAddr = dma;
+	}
+
+	fpos = 0;
+	while (verify && !result) {		// Reads both files half a buffer at a time, as records
+		recs = _sys_loadfile(from, fpos, address, address + half);
+		if (_sys_loadfile(to, fpos, address + half, address + 2 * half) != recs || memcmp(_RamSysAddr(address), _RamSysAddr(address + half), recs * BlkSZ))
+			result = 3;
+		if (!recs)
+			break;
+		fpos += (long)recs * BlkSZ;
+	}
+	return(result);
+}
+
 static uint8 findNextDirName[13];
 static uint16 fileRecords = 0;
 static uint16 fileExtents = 0;
@@ -324,44 +962,89 @@ uint8 _findnext(uint8 isdir) {
 	uint8 result = 0xff;
 	bool isfile;
 	uint32 bytes;
+	DIRIDX_ENTRY* e;
+#ifdef RAMDISK
+	RD_FILE* r;
+#endif
+#ifdef ROMDISK
+	RO_FILE* o;
+#endif
 
 	digitalWrite(LED, HIGH ^ LEDinv);
 	if (allExtents && fileRecords) {
 		_mockupDirEntry(0);
 		result = 0;
 	} else {
-		while ((f = userdir.openNextFile())) {
-			f.getName((char*)&findNextDirName[0], 13);
-			isfile = !f.isDirectory();
-			bytes = f.size();
-			f.dirEntry(&fileDirEntry);
-			f.close();
-			if (!isfile)
-				continue;
-			_HostnameToFCBname(findNextDirName, fcbname);
-			if (match(fcbname, pattern)) {
-				if (isdir) {
-					// account for host files that aren't multiples of the block size
-					// by rounding their bytes up to the next multiple of blocks
-					if (bytes & (BlkSZ - 1)) {
-						bytes = (bytes & ~(BlkSZ - 1)) + BlkSZ;
-					}
-					fileRecords = bytes / BlkSZ;
-					fileExtents = fileRecords / BlkEX + ((fileRecords & (BlkEX - 1)) ? 1 : 0);
-					fileExtentsUsed = 0;
-					firstFreeAllocBlock = firstBlockAfterDir;
-					_mockupDirEntry(0);
-				} else {
-					fileRecords = 0;
-					fileExtents = 0;
-					fileExtentsUsed = 0;
-					firstFreeAllocBlock = firstBlockAfterDir;
+		while (true) {
+#ifdef RAMDISK
+			if (rdFind) {		// Matches against the RAM drive
+				if (!(r = _rd_findnext(&rdFindPos, allUsers ? 0xff : rdFindUser, pattern)))
+					break;
+				if (allUsers)
+					currFindUser = r->user;
+				memcpy(fcbname, r->name, 11);
+				fcbname[11] = 0;
+				_FCBnameToHostname(fcbname, findNextDirName);
+				bytes = r->size;
+			} else
+#endif
+#ifdef ROMDISK
+			if (roFind) {		// Matches against the ROM drive
+				if (!(o = _ro_findnext(&roFindPos, allUsers ? 0xff : roFindUser, pattern)))
+					break;
+				if (allUsers)
+					currFindUser = o->user;
+				memcpy(fcbname, o->name, 11);
+				fcbname[11] = 0;
+				_FCBnameToHostname(fcbname, findNextDirName);
+				bytes = o->size;
+			} else
+#endif
+			if (findIndex) {	// Matches against the in memory index
+				if (findPos >= findIndex->count)
+					break;
+				e = &findIndex->entry[findPos++];
+				memcpy(fcbname, e->name, 11);
+				fcbname[11] = 0;
+				if (!match(fcbname, pattern))
+					continue;
+				_FCBnameToHostname(fcbname, findNextDirName);
+				bytes = e->size;
+			} else {			// or reads the folder from the card
+				if (!(f = userdir.openNextFile()))
+					break;
+				f.getName((char*)&findNextDirName[0], 13);
+				isfile = !f.isDirectory();
+				bytes = f.size();
+				f.dirEntry(&fileDirEntry);
+				f.close();
+				if (!isfile)
+					continue;
+				_HostnameToFCBname(findNextDirName, fcbname);
+				if (!match(fcbname, pattern))
+					continue;
+			}
+			if (isdir) {
+				// account for host files that aren't multiples of the block size
+				// by rounding their bytes up to the next multiple of blocks
+				if (bytes & (BlkSZ - 1)) {
+					bytes = (bytes & ~(BlkSZ - 1)) + BlkSZ;
 				}
-				_RamWrite(tmpFCB, filename[0] - '@');
-				_HostnameToFCB(tmpFCB, findNextDirName);
-				result = 0x00;
-				break;
+				fileRecords = bytes / BlkSZ;
+				fileExtents = fileRecords / BlkEX + ((fileRecords & (BlkEX - 1)) ? 1 : 0);
+				fileExtentsUsed = 0;
+				firstFreeAllocBlock = firstBlockAfterDir;
+				_mockupDirEntry(0);
+			} else {
+				fileRecords = 0;
+				fileExtents = 0;
+				fileExtentsUsed = 0;
+				firstFreeAllocBlock = firstBlockAfterDir;
 			}
+			_RamWrite(tmpFCB, filename[0] - '@');
+			_HostnameToFCB(tmpFCB, findNextDirName);
+			result = 0x00;
+			break;
 		}
 	}
 	digitalWrite(LED, LOW ^ LEDinv);
@@ -374,7 +1057,40 @@ uint8 _findfirst(uint8 isdir) {
 	path[2] = filename[2];
 	if (userdir)
 		userdir.close();
-	userdir = SD.open((char*)path); // Set directory search to start from the first position
+#ifdef RAMDISK
+	rdFind = _rd_isram(filename);
+	if (rdFind) {
+		rdFindPos = 0;
+		rdFindUser = path[2] <= '9' ? path[2] - '0' : toupper(path[2]) - 'A' + 10;
+		findIndex = NULL;
+		_HostnameToFCBname(filename, pattern);
+		fileRecords = 0;
+		fileExtents = 0;
+		fileExtentsUsed = 0;
+		return(_findnext(isdir));
+	}
+#endif
+#ifdef ROMDISK
+	roFind = _ro_isrom(filename);
+	if (roFind) {
+		roFindPos = 0;
+		roFindUser = path[2] <= '9' ? path[2] - '0' : toupper(path[2]) - 'A' + 10;
+		findIndex = NULL;
+		_HostnameToFCBname(filename, pattern);
+		fileRecords = 0;
+		fileExtents = 0;
+		fileExtentsUsed = 0;
+		return(_findnext(isdir));
+	}
+#endif
+#ifdef WRITEBEHIND
+	_wb_drain();	// Listings show the file sizes
+#endif
+	findIndex = NULL;	// The last search is over, its index slot can be reused
+	findIndex = _sys_dirindex(path[0], path[2]);
+	findPos = 0;
+	if (!findIndex)
+		userdir = SD.open((char*)path); // Set directory search to start from the first position
 	_HostnameToFCBname(filename, pattern);
 	fileRecords = 0;
 	fileExtents = 0;
@@ -387,6 +1103,14 @@ uint8 _findnextallusers(uint8 isdir) {
 	char dirname[13];
 	bool done = false;
 
+#ifdef RAMDISK
+	if (rdFind)
+		return(_findnext(isdir));
+#endif
+#ifdef ROMDISK
+	if (roFind)
+		return(_findnext(isdir));
+#endif
 	while (!done) {
 		while (!userdir) {
 			userdir = rootdir.openNextFile();
@@ -397,6 +1121,9 @@ uint8 _findnextallusers(uint8 isdir) {
 			userdir.getName(dirname, sizeof dirname);
 			if (userdir.isDirectory() && strlen(dirname) == 1 && isxdigit(dirname[0])) {
 				currFindUser = dirname[0] <= '9' ? dirname[0] - '0' : toupper(dirname[0]) - 'A' + 10;
+				findIndex = NULL;	// Done with the last folder
+				findIndex = _sys_dirindex(filename[0], toupper(dirname[0]));
+				findPos = 0;
 				break;
 			}
 			userdir.close();
@@ -424,6 +1151,32 @@ uint8 _findfirstallusers(uint8 isdir) {
 		rootdir.close();
 	if (userdir)
 		userdir.close();
+	findIndex = NULL;
+#ifdef RAMDISK
+	rdFind = _rd_isram(filename);
+	if (rdFind) {
+		rdFindPos = 0;
+		strcpy((char*)pattern, "???????????");
+		fileRecords = 0;
+		fileExtents = 0;
+		fileExtentsUsed = 0;
+		return(_findnext(isdir));
+	}
+#endif
+#ifdef ROMDISK
+	roFind = _ro_isrom(filename);
+	if (roFind) {
+		roFindPos = 0;
+		strcpy((char*)pattern, "???????????");
+		fileRecords = 0;
+		fileExtents = 0;
+		fileExtentsUsed = 0;
+		return(_findnext(isdir));
+	}
+#endif
+#ifdef WRITEBEHIND
+	_wb_drain();
+#endif
 	rootdir = SD.open((char*)path); // Set directory search to start from the first position
 	strcpy((char*)pattern, "???????????");
 	if (!rootdir)
@@ -438,11 +1191,23 @@ uint8 _Truncate(char* filename, uint8 rc) {
 	File32 f;
 	int result = 0;
 
+#ifdef RAMDISK
+	if (_rd_isram((uint8*)filename))
+		return(_rd_truncate((uint8*)filename, rc));
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom((uint8*)filename))
+		return(0);
+#endif
+#ifdef WRITEBEHIND
+	_wb_barrier((uint8*)filename, false);
+#endif
 	digitalWrite(LED, HIGH ^ LEDinv);
-	f = SD.open((char*)filename, O_WRITE | O_APPEND);
+	f = _sys_open((uint8*)filename, O_WRITE | O_APPEND);
 	if (f) {
 		if (f.truncate(rc * BlkSZ)) {
 			f.close();
+			_sys_dirchanged((uint8*)filename);
 			result = 1;
 		}
 	}
@@ -456,8 +1221,21 @@ void _MakeUserDir() {
 
 	uint8 path[4] = { dFolder, FOLDERCHAR, uFolder, 0 };
 
+#ifdef RAMDISK
+	if (_rd_isram(path))
+		return;
+#endif
+#ifdef ROMDISK
+	if (_ro_isrom(path))
+		return;
+#endif
+	if (cDrive < 16 && (knownUsers[cDrive] & (1UL << userCode)))
+		return;
 	digitalWrite(LED, HIGH ^ LEDinv);
-	SD.mkdir((char*)path);
+	if ((SD.mkdir((char*)path) || SD.exists((char*)path)) && cDrive < 16) {	// A card that failed is asked again next time
+		knownUsers[cDrive] |= 1UL << userCode;
+		checkedDrives &= ~(1 << cDrive);	// mkdir may also have created the drive folder
+	}
 	digitalWrite(LED, LOW ^ LEDinv);
 }
 
@@ -469,11 +1247,24 @@ uint8 _sys_makedisk(uint8 drive) {
 		uint8 dFolder = drive + '@';
 		uint8 disk[2] = { dFolder, 0 };
 		digitalWrite(LED, HIGH ^ LEDinv);
+#ifdef RAMDISK
+		if (_rd_isram(disk)) {
+			result = 0xfe;	// The RAM drive always exists
+		} else
+#endif
+#ifdef ROMDISK
+		if (_ro_isrom(disk)) {
+			result = 0xfe;	// The ROM drive can not be made
+		} else
+#endif
 		if (!SD.mkdir((char*)disk)) {
 			result = 0xfe;
 		} else {
 			uint8 path[4] = { dFolder, FOLDERCHAR, '0', 0 };
 			SD.mkdir((char*)path);
+			checkedDrives |= 1 << (drive - 1);
+			knownDrives |= 1 << (drive - 1);
+			knownUsers[drive - 1] |= 1;
 		}
 		digitalWrite(LED, LOW ^ LEDinv);
 	}
@@ -552,15 +1343,32 @@ uint32 _HardwareIn(const uint32 Port) {
 
 #include "arduino_hooks.h"
 
+// Bytes waiting on the serial console
+int _serial_available(void) {
+#ifdef SERIAL_RXRING
+	return(_rx_available());
+#else
+	return(Serial1.available());
+#endif
+}
+
+uint8 _serial_read(void) {
+#ifdef SERIAL_RXRING
+	return(_rx_read());
+#else
+	return(Serial1.read());
+#endif
+}
+
 int _kbhit(void) {
     if (_kbhit_hook && _kbhit_hook()) { return true; }
-    return(Serial1.available());
+    return(_serial_available());
 }
 
 uint8 _getch(void) {
     while(true) {
         if(_kbhit_hook && _kbhit_hook()) { return _getch_hook(); }
-        if(Serial1.available()) { return Serial1.read(); }
+        if(_serial_available()) { return _serial_read(); }
     }
 }
 
@@ -575,17 +1383,35 @@ uint8 _getche(void) {
 }
 */
 
+// Sends len bytes to the serial console
+void _serial_write(const uint8* buf, uint16 len) {
+#ifdef SERIAL_TXRING
+	_tx_write(buf, len);
+#else
+	Serial1.write(buf, len);
+#endif
+}
+
 void _putch(uint8 ch) {
-	Serial1.write(ch);
+	_serial_write(&ch, 1);
         if(_putch_hook) _putch_hook(ch);
 }
 
+void _putbuf(const uint8* buf, uint16 len) {
+	_serial_write(buf, len);
+	if (_putbuf_hook) {
+		_putbuf_hook(buf, len);
+	} else if (_putch_hook) {
+		while (len--)
+			_putch_hook(*buf++);
+	}
+}
+
 void _clrscr(void) {
-	Serial1.print("\e[H\e[J");
+	_serial_write((const uint8*)"\e[H\e[J", 6);
 
 #if USE_DISPLAY
-    display.fillScreen(0);
-    display.setCursor(0, 0);
+    ClearScreen();
 #endif
 
 }
@@ -7,4 +7,5 @@
 bool (*_kbhit_hook)(void);
 uint8_t (*_getch_hook)(void);
 void (*_putch_hook)(uint8_t ch);
+void (*_putbuf_hook)(const uint8_t *buf, uint16_t len);
 
@@ -10,4 +10,5 @@
 extern bool (*_kbhit_hook)(void);
 extern uint8_t (*_getch_hook)(void);
 extern void (*_putch_hook)(uint8_t ch);
+extern void (*_putbuf_hook)(const uint8_t *buf, uint16_t len);
 
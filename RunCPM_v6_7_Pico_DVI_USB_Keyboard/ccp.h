@@ -11,6 +11,7 @@
 
 #define inBuf	(BDOSjmppage - 256)     // Input buffer location
 #define cmdLen	125						// Maximum size of a command line (sz+rd+cmd+\0)
+#define subLen	4096					// Size of the batch queue, where the lines of a .SUB file wait to run
 
 #define defDMA	0x0080					// Default DMA address
 #define defLoad	0x0100					// Default load address
@@ -24,6 +25,11 @@ uint8 parDrive = 0;             // 0 -> 15 = A -> P .. Drive for the first file
 uint8 curUser = 0;              // 0 -> 15			.. Current user area to access
 bool sFlag = FALSE;             // Submit Flag
 uint8 sRecs = 0;                // Number of records on the Submit file
+uint8 subQueue[subLen];         // Batch lines waiting to run, kept at the end of the queue, each one ended by a \0
+uint16 subHead = subLen;        // First batch line waiting to run, subLen if there is none
+#ifdef SUBMIT_PERSIST
+bool subOnDisk = FALSE;         // The batch was written to $$$.SUB on a warm boot, the rest of it runs from there
+#endif
 uint8 prompt[8] = "\r\n  >";
 uint16 pbuf, perr;
 uint8 blen = 0;                 // Actual size of the typed command line (size of the buffer)
@@ -44,6 +50,7 @@ static const char *Commands[] =
     "DEL",
     "EXIT",
     "PAGE",
+    "COPY",
 #endif
     "VOL",
     "?",
@@ -92,7 +99,7 @@ uint8 _ccp_cnum(void) {
     }
 #ifndef Internals
     if (result != 255)
-        result += 10;
+        result += 11;
 #endif
     return (result);
 } // _ccp_cnum
@@ -373,6 +380,157 @@ uint8 _ccp_page(void) {
     }
     return (error);
 } // _ccp_page
+
+// Reads a file name with an optional du:, d: or u: prefix from the command line onto fcb, returns its user, 0xff if invalid
+uint8 _ccp_copyname(uint16 fcb) {
+    uint8 user = curUser, drive = 0, i, ch;
+    uint16 u = 0;
+    bool digits = FALSE;
+
+    while (_RamRead(pbuf) == ' ' && blen) {     // Skips any leading spaces
+        ++pbuf;
+        --blen;
+    }
+    for (i = 0; i < blen; ++i) {
+        ch = toupper(_RamRead(pbuf + i));
+        if (!i && ch >= 'A' && ch <= 'P') {
+            drive = ch - '@';
+        } else if (ch >= '0' && ch <= '9' && u < 100) {
+            u = (u * 10) + (ch - '0');
+            digits = TRUE;
+        } else {
+            break;
+        }
+    }
+    if (i && i < blen && _RamRead(pbuf + i) == ':') {     // Found a prefix
+        if (u > 15)
+            return(0xff);
+        _RamWrite(fcb, drive);
+        if (digits)
+            user = (uint8)u;
+        pbuf += i + 1;
+        blen -= i + 1;
+    }
+    if (blen && _RamRead(pbuf) != '[')
+        _ccp_nameToFCB(fcb);
+    return(user);
+} // _ccp_copyname
+
+// COPY command
+uint8 _ccp_copy(void) {
+    uint8 dst[12];                              // Destination drive and name, ? where the source name is kept
+    uint8 from[17], to[17];                     // Host names of the file being copied
+    uint8 sUser, dUser, sDrive, dDrive, i, ch;
+    uint16 names = defLoad;                     // Names of the files found, 11 bytes each
+    uint16 buf = defLoad + 0x1000;              // Copy buffer, from the end of the names up to the input buffer
+    uint16 files = 0, f;
+    bool verify = FALSE;
+
+    pbuf = defDMA + 1;                          // Parses the command tail again, now allowing du: prefixes
+    blen = _RamRead(defDMA);
+    _ccp_initFCB(ParFCB, 36);
+    sUser = _ccp_copyname(ParFCB);
+    _ccp_initFCB(SecFCB, 16);
+    dUser = _ccp_copyname(SecFCB);
+    while (_RamRead(pbuf) == ' ' && blen) {
+        ++pbuf;
+        --blen;
+    }
+    if (blen && _RamRead(pbuf) == '[') {
+        ++pbuf;
+        --blen;
+    }
+    if (blen && toupper(_RamRead(pbuf)) == 'V') {    // Verify option
+        verify = TRUE;
+        ++pbuf;
+        --blen;
+        if (blen && _RamRead(pbuf) == ']') {
+            ++pbuf;
+            --blen;
+        }
+    }
+    while (_RamRead(pbuf) == ' ' && blen) {
+        ++pbuf;
+        --blen;
+    }
+    if (blen || sUser == 0xff || dUser == 0xff || _RamRead(ParFCB + 1) == ' ')
+        return(TRUE);
+
+    for (i = 0; i < 12; ++i)
+        dst[i] = _RamRead(SecFCB + i);
+    if (dst[1] == ' ') {                        // No destination name, keeps the source names
+        for (i = 1; i < 12; ++i)
+            dst[i] = '?';
+    }
+    sDrive = _RamRead(ParFCB) ? _RamRead(ParFCB) - 1 : curDrive;
+    dDrive = dst[0] ? dst[0] - 1 : curDrive;
+    _RamWrite(ParFCB, sDrive + 1);
+
+    _puts("\r\n");
+    if (_SelectDisk(dDrive + 1))
+        return(FALSE);
+    if (roVector & (1 << dDrive)) {
+        _puts("Disk R/O");
+        return(FALSE);
+    }
+    cDrive = dDrive;
+    _ccp_bdos(F_USERNUM, dUser);                // Creates the destination user folder if needed
+
+    cDrive = sDrive;
+    _ccp_bdos(F_USERNUM, sUser);
+    if (!_SearchFirst(ParFCB, TRUE)) {          // Lists the files first, as copying would disturb the search
+        do {
+            for (i = 0; i < 11; ++i)
+                _RamWrite(names + files * 11 + i, _RamRead(tmpFCB + 1 + i) & 0x7f);
+            ++files;
+        } while (files < (buf - names) / 11 && !_SearchNext(ParFCB, TRUE));
+    }
+    if (!files)
+        _puts("No file");
+
+    for (f = 0; f < files; ++f) {
+        _ccp_initFCB(CmdFCB, 36);
+        _RamWrite(CmdFCB, sDrive + 1);
+        for (i = 0; i < 11; ++i)
+            _RamWrite(CmdFCB + 1 + i, _RamRead(names + f * 11 + i));
+        cDrive = sDrive;
+        _ccp_bdos(F_USERNUM, sUser);
+        _FCBtoHostname(CmdFCB, from);
+        _ccp_printfcb(CmdFCB, TRUE);
+        _puts(" to ");
+
+        _RamWrite(CmdFCB, dDrive + 1);
+        for (i = 0; i < 11; ++i) {
+            ch = dst[i + 1];
+            _RamWrite(CmdFCB + 1 + i, ch == '?' ? _RamRead(names + f * 11 + i) : ch);
+        }
+        cDrive = dDrive;
+        _ccp_bdos(F_USERNUM, dUser);
+        _FCBtoHostname(CmdFCB, to);
+        _ccp_printfcb(CmdFCB, TRUE);
+
+        if (!strcmp((char *)from, (char *)to)) {
+            _puts("  Same file");
+        } else {
+            switch (_sys_copyfile(from, to, buf, inBuf, verify)) {
+                case 0:
+                    break;
+                case 1:
+                    _puts("  Read error");
+                    break;
+                case 2:
+                    _puts("  Write error");
+                    break;
+                default:
+                    _puts("  Verify error");
+                    break;
+            }
+        }
+        _puts("\r\n");
+    }
+    _ccp_bdos(F_USERNUM, curUser);
+    return(FALSE);
+} // _ccp_copy
 #endif
 
 // VOL command
@@ -382,6 +540,7 @@ uint8 _ccp_vol(void) {
     uint8 folder[5] = {letter, FOLDERCHAR, '0', FOLDERCHAR, 0};
     uint8 filename[13] = {letter, FOLDERCHAR, '0', FOLDERCHAR, 'I', 'N', 'F', 'O', '.', 'T', 'X', 'T', 0};
     uint8 bytesread;
+    uint8 recs;
     uint8 i, j;
     
     _puts("\r\nVolumes on ");
@@ -395,7 +554,8 @@ uint8 _ccp_vol(void) {
             _putcon(i < 10 ? folder[2] : 38 + i);
             _puts(": ");
             filename[2] = i < 10 ? i + 48 : i + 55;
-            bytesread = (uint8)_sys_readseq(filename, 0);
+            recs = 1;
+            bytesread = (uint8)_sys_readseq(filename, 0, &recs);
             if (!bytesread) {
                 for (j = 0; j < 128; ++j) {
                     if ((_RamRead(dmaAddr + j) < 32) || (_RamRead(dmaAddr + j) > 126))
@@ -414,6 +574,8 @@ uint8 _ccp_hlp(void) {
     _puts("\r\nCCP Commands:\r\n");
     _puts("\t? - Shows this list of commands\r\n");
     _puts("\tCLS - Clears the screen\r\n");
+    _puts("\tCOPY [du:]<file> [du:][<file>] [V] - Copies files\r\n");
+    _puts("\t    wildcards allowed, V verifies the copies\r\n");
     _puts("\tDEL - Alias to ERA\r\n");
     _puts("\tEXIT - Terminates RunCPM\r\n");
     _puts("\tPAGE [<n>] - Sets the page size for TYPE\r\n");
@@ -423,6 +585,144 @@ uint8 _ccp_hlp(void) {
     return(FALSE);
 }
 
+// Moves the n bytes of lines staged at the start of the batch queue in front of the lines waiting to run
+void _ccp_subpush(uint16 n) {
+    memmove(&subQueue[subHead - n], subQueue, n);
+    subHead -= n;
+} // _ccp_subpush
+
+// Adds a character to the line being staged at the start of the batch queue, returns FALSE if it does not fit
+bool _ccp_subput(uint16 *n, uint8 *len, uint8 ch) {
+    if (*n >= subHead || (ch && *len >= cmdLen))
+        return(FALSE);
+    subQueue[(*n)++] = ch;
+    if (ch)
+        ++*len;
+    else
+        *len = 0;
+    return(TRUE);
+} // _ccp_subput
+
+// Loads the .SUB file opened on CmdFCB onto the batch queue, $1 to $9 are replaced by the parameters on the command line
+// $$ is a $ and ^x is the control character x, as done by SUBMIT.COM
+uint8 _ccp_subload(void) {
+    char tail[128];
+    char *par[9];
+    char *p;
+    uint8 pars = 0, len, i, ch, next;
+    uint16 n = 0, addr, end;
+    bool fits = TRUE;
+
+    len = _RamRead(defDMA);                         // Splits the command tail into its parameters
+    for (i = 0; i < len && i < 127; ++i)
+        tail[i] = _RamRead(defDMA + 1 + i);
+    tail[i] = 0;
+    for (p = tail; pars < 9; ) {
+        while (*p == ' ')
+            ++p;
+        if (!*p)
+            break;
+        par[pars++] = p;
+        while (*p && *p != ' ')
+            ++p;
+        if (*p)
+            *p++ = 0;
+    }
+
+    end = defLoad + _LoadFile(CmdFCB, defLoad, BDOSjmppage) * 128;   // Reads the whole file into the TPA
+    len = 0;
+    for (addr = defLoad; addr < end && fits; ++addr) {
+        ch = _RamRead(addr);
+        next = addr + 1 < end ? _RamRead(addr + 1) : 0;
+        if (ch == 0x1a)                             // End of file
+            break;
+        if (ch == '\r')
+            continue;
+        if (ch == '\n') {                           // End of line
+            fits = _ccp_subput(&n, &len, 0);
+        } else if (ch == '$' && next >= '1' && next <= '9') {   // Parameter, empty if it was not given
+            for (p = next - '0' <= pars ? par[next - '1'] : (char *)""; *p && fits; ++p)
+                fits = _ccp_subput(&n, &len, *p);
+            ++addr;
+        } else {
+            if (ch == '$' && next == '$') {
+                ++addr;
+            } else if (ch == '^' && toupper(next) >= '@' && toupper(next) <= '_') {
+                ch = toupper(next) - '@';
+                ++addr;
+            }
+            fits = _ccp_subput(&n, &len, ch);
+        }
+    }
+    if (fits && len)                                // Last line had no line break
+        fits = _ccp_subput(&n, &len, 0);
+    if (fits)
+        _ccp_subpush(n);
+    else
+        _puts("\r\nBatch too long");
+    return(FALSE);
+} // _ccp_subload
+
+// Moves the lines of the $$$.SUB file onto the batch queue, so they run from memory, and deletes the file
+// If they do not fit the file is left for _ccp_readInput to run it from the disk
+void _ccp_subimport(void) {
+    uint16 n = 0;
+    uint8 recs, chars, i;
+
+    if (_ccp_bdos(F_OPEN, BatchFCB))
+        return;
+    recs = _RamRead(BatchFCB + 15);
+    _ccp_bdos(F_DMAOFF, defDMA);
+    while (recs--) {                                // The last record holds the first line
+        _RamWrite(BatchFCB + 32, recs);
+        _ccp_bdos(F_READ, BatchFCB);
+        chars = _RamRead(defDMA);
+        if (chars > 127 || n + chars + 1 > subHead)
+            return;
+        for (i = 0; i < chars; ++i)
+            subQueue[n++] = _RamRead(defDMA + 1 + i);
+        subQueue[n++] = 0;
+    }
+    _ccp_subpush(n);
+    _ccp_bdos(F_DELETE, BatchFCB);
+    sFlag = FALSE;
+} // _ccp_subimport
+
+#ifdef SUBMIT_PERSIST
+// Writes the batch lines still waiting to run onto $$$.SUB, the way SUBMIT.COM does, last line on the first record
+void _ccp_subsave(void) {
+    uint16 start, end = subLen;
+    uint8 i;
+
+    _ccp_initFCB(BatchFCB, 36);
+    for (i = 0; i < 3; ++i)
+        _RamWrite(BatchFCB + 1 + i, '$');
+    _RamWrite(BatchFCB + 9, 'S');
+    _RamWrite(BatchFCB + 10, 'U');
+    _RamWrite(BatchFCB + 11, 'B');
+#ifdef BATCHA
+    _RamWrite(BatchFCB, 1);
+#endif
+    _ccp_bdos(F_DELETE, BatchFCB);
+    if (_ccp_bdos(F_MAKE, BatchFCB))
+        return;
+    _ccp_bdos(F_DMAOFF, defDMA);
+    while (end > subHead) {
+        start = end - 1;                            // Finds the start of the last line
+        while (start > subHead && subQueue[start - 1])
+            --start;
+        _RamWrite(defDMA, end - 1 - start);
+        for (i = 0; i < 127; ++i)
+            _RamWrite(defDMA + 1 + i, start + i < end - 1 ? subQueue[start + i] : 0);
+        _ccp_bdos(F_WRITE, BatchFCB);
+        end = start;
+    }
+    _ccp_bdos(F_CLOSE, BatchFCB);
+    subHead = subLen;
+    subOnDisk = TRUE;
+} // _ccp_subsave
+#endif
+
 // External (.COM) command
 uint8 _ccp_ext(void) {
     bool error = TRUE, found = FALSE;
@@ -494,73 +794,23 @@ uint8 _ccp_ext(void) {
             _ccp_bdos(F_USERNUM, curUser);                  // restore to previous user
         }
 
-        if (found) {
-            //_puts(".SUB file found!\n");
-            int i;
-
-            //move FCB's (CmdFCB --> ParFCB --> SecFCB)
-            for (i = 0; i < 16; i++) {
-                //ParFCB to SecFCB
-                _RamWrite(SecFCB + i, _RamRead(ParFCB + i));
-                //CmdFCB to ParFCB
-                _RamWrite(ParFCB + i, _RamRead(CmdFCB + i));
-            }
-            // (Re)Initialize the CmdFCB
-            _ccp_initFCB(CmdFCB, 36);
-            
-            //put 'SUBMIT.COM' in CmdFCB
-            const char *str = "SUBMIT  COM";
-            int s = (int)strlen(str);
-            for (i = 0; i < s; i++)
-                _RamWrite(CmdFCB + i + 1, str[i]);
-            
-            //now try to find SUBMIT.COM file
-            found = !_ccp_bdos(F_OPEN, CmdFCB);                 // Look for the program on the FCB drive, current or specified
-            if (!found) {                                       // If not found
-                if (!drive) {                                   // and the search was on the default drive
-                    _RamWrite(CmdFCB, 0x01);                    // Then look on drive A: user 0
-                    if (curUser) {
-                        user = curUser;                         // Save the current user
-                        _ccp_bdos(F_USERNUM, 0x0000);           // then set it to 0
-                    }
-                    found = !_ccp_bdos(F_OPEN, CmdFCB);
-                    if (!found) {                               // If still not found then
-                        if (curUser) {                          // If current user not = 0
-                            _RamWrite(CmdFCB, 0x00);            // look on current drive user 0
-                            found = !_ccp_bdos(F_OPEN, CmdFCB); // and try again
-                        }
-                    }
-                }
-            }
-            if (found) {
-                //insert "@" into command buffer
-                //note: this is so the rest will be parsed correctly
-                blen = _RamRead(defDMA);
-                if (blen < cmdLen) {
-                    blen++;
-                    _RamWrite(defDMA, blen);
-                }
-                uint8 lc = '@';
-                for (i = 0; i < blen; i++) {
-                    uint8 nc = _RamRead(defDMA + 1 + i);
-                    _RamWrite(defDMA + 1 + i, lc);
-                    lc = nc;
-                }
+        if (found) {                                        // Runs it from the batch queue
+            found = FALSE;
+            error = _ccp_subload();
+            if (user) {                                     // Back to the user and drive it was looked for from
+                _ccp_bdos(F_USERNUM, curUser);
+                user = 0;
             }
+            _RamWrite(CmdFCB, drive);
+            cDrive = oDrive;
         }
     }
 
     if (found) {										// Program was found somewhere
         _puts("\r\n");
-        _ccp_bdos(F_DMAOFF, loadAddr);					// Sets the DMA address for the loading
-        while (!_ccp_bdos(F_READ, CmdFCB)) {			// Loads the program into memory
-            loadAddr += 128;
-            if (loadAddr == BDOSjmppage) {				// Breaks if it reaches the end of TPA
-                _puts("\r\nNo Memory");
-                break;
-            }
-            _ccp_bdos(F_DMAOFF, loadAddr);				// Points the DMA offset to the next loadAddr
-        }
+        loadAddr += _LoadFile(CmdFCB, loadAddr, BDOSjmppage) * 128;	// Loads the program into memory
+        if (loadAddr == BDOSjmppage)					// Warns if it reached the end of TPA
+            _puts("\r\nNo Memory");
         _ccp_bdos(F_DMAOFF, defDMA);					// Points the DMA offset back to the default
         
         if (user) {										// If a user was selected
@@ -584,6 +834,7 @@ uint8 _ccp_ext(void) {
         SP = BDOSjmppage;								// Sets the stack to the top of the TPA
         
         Z80run();										// Starts Z80 simulation
+        _ccp_bdos(F_MULTISEC, 1);						// Goes back to single record transfers
         
         error = FALSE;
     }
@@ -608,12 +859,19 @@ void _ccp_cmdError() {
     _puts("?\r\n");
 } // _ccp_cmdError
 
-// Reads input, either from the $$$.SUB or console
+// Reads input, either from the batch queue, the $$$.SUB or console
 void _ccp_readInput(void) {
     uint8 i;
     uint8 chars;
     
-    if (sFlag) {                                // Are we running a submit?
+    if (subHead < subLen) {                     // Are we running a batch from memory?
+        chars = strlen((char *)&subQueue[subHead]);
+        _RamWrite(inBuf + 1, chars);            // Moves its next line to the input buffer
+        for (i = 0; i <= chars; ++i)
+            _RamWrite(inBuf + i + 2, subQueue[subHead + i]);
+        subHead += chars + 1;
+        _puts((char *)_RamSysAddr(inBuf + 2));
+    } else if (sFlag) {                         // Are we running a submit from the disk?
         if (!sRecs) {                           // Are we already counting?
             _ccp_bdos(F_OPEN, BatchFCB);        // Open the batch file
             sRecs = _RamRead(BatchFCB + 15);    // Gets its record count
@@ -671,6 +929,15 @@ void _ccp(void) {
         _RamWrite(inBuf + 1, 0);                    // Clears the buffer
         blen = 0;
     }
+#ifdef SUBMIT_PERSIST
+    if (!sFlag)                                     // The batch written on a warm boot is over
+        subOnDisk = FALSE;
+    if (sFlag && !subOnDisk)                        // Runs a $$$.SUB left by SUBMIT.COM from memory
+        _ccp_subimport();
+#else
+    if (sFlag)                                      // Runs a $$$.SUB left by SUBMIT.COM from memory
+        _ccp_subimport();
+#endif
 
     while (TRUE) {
         curDrive = (uint8)_ccp_bdos(DRV_GET, 0x0000);   // Get current drive
@@ -679,7 +946,7 @@ void _ccp(void) {
         
         parDrive = curDrive;                            // Initially the parameter drive is the same as the current drive
 
-        sprintf((char *) prompt, "\r\n%c%u%c", 'A' + curDrive, curUser, sFlag ? '$' : '>');
+        sprintf((char *) prompt, "\r\n%c%u%c", 'A' + curDrive, curUser, sFlag || subHead < subLen ? '$' : '>');
         if(!blen){
             _puts((char *)prompt);
 
@@ -837,14 +1104,19 @@ void _ccp(void) {
                     i = _ccp_page();
                     break;
                 }
+
+                case 10: {          // COPY
+                    i = _ccp_copy();
+                    break;
+                }
 #endif
                     
-                case 10: {          // VOL
+                case 11: {          // VOL
                     i = _ccp_vol();
                     break;
                 }
 
-                case 11: {          // HELP
+                case 12: {          // HELP
                     i = _ccp_hlp();
                     break;
                 }
@@ -865,6 +1137,10 @@ void _ccp(void) {
                 _ccp_cmdError();
         }
         blen = 0;
+#ifdef SUBMIT_PERSIST
+        if (Status == 2 && subHead < subLen)           // A program warm booted in the middle of a batch, from now on
+            _ccp_subsave();                             // the rest of it runs from $$$.SUB where the program can see it
+#endif
         if ((Status == 1) || (Status == 2))
             break;
     }
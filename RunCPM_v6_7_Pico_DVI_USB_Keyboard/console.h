@@ -8,6 +8,7 @@
 extern int _kbhit(void);
 uint8_t _getch(void);
 void _putch(uint8 ch);
+void _putbuf(const uint8* buf, uint16 len);
 
 /* see main.c for definition */
 
@@ -35,10 +36,28 @@ void _putcon(uint8 ch)		// Puts a character
 	_putch(ch & mask8bit);
 }
 
+void _putconbuf(const uint8* buf, uint16 len)	// Puts len characters
+{
+	uint8 masked[128];
+	uint16 i, n;
+
+	if (mask8bit == 0xff) {
+		_putbuf(buf, len);
+		return;
+	}
+	while (len) {
+		n = len < sizeof(masked) ? len : sizeof(masked);
+		for (i = 0; i < n; ++i)
+			masked[i] = buf[i] & mask8bit;
+		_putbuf(masked, n);
+		buf += n;
+		len -= n;
+	}
+}
+
 void _puts(const char* str)	// Puts a \0 terminated string
 {
-	while (*str)
-		_putcon(*(str++));
+	_putconbuf((const uint8*)str, strlen(str));
 }
 
 void _puthex8(uint8 c)		// Puts a HH hex string
@@ -169,11 +169,19 @@ void _PatchBIOS(void) {
 void _PatchCPM(void) {
 	uint16 i;
 
+#ifdef DISKIMAGE
+	_img_reset();	// Images are looked for again on every boot
+#endif
+#ifdef WRITEBEHIND
+	_wb_drain();
+#endif
+
 	// **********  Patch CP/M page zero into the memory  **********
 
 	/* BIOS entry point */
 	_RamWrite(0x0000,   JP);  /* JP BIOS+3 (warm boot) */
 	_RamWrite16(0x0001, BIOSjmppage + 3);
+	multiSec = 1;	// The multi-sector count goes back to 1 on every boot
 	if (Status != 2) {
 		/* IOBYTE - Points to Console */
 		_RamWrite(	IOByte,		0x3D);
@@ -540,10 +548,28 @@ void _Bios(void) {
 
 	switch (ch) {
 		case B_BOOT: {
+#ifdef DISKIMAGE
+			_img_flush();
+#endif
+#ifdef WRITEBEHIND
+			_wb_drain();
+#endif
+#if defined USE_PUN || defined USE_LST
+			_sys_devidle(true);
+#endif
 			Status = 1;		// 0 - Ends RunCPM
 			break;
 		}
 		case B_WBOOT: {
+#ifdef DISKIMAGE
+			_img_flush();
+#endif
+#ifdef WRITEBEHIND
+			_wb_drain();
+#endif
+#if defined USE_PUN || defined USE_LST
+			_sys_devidle(true);
+#endif
 			Status = 2;		// 1 - Back to CCP
 			break;
 		}
@@ -552,6 +578,12 @@ void _Bios(void) {
 			break;
 		}
 		case B_CONIN: {		// 3 - Console input
+#ifdef WRITEBEHIND
+			_wb_idle(true);
+#endif
+#if defined USE_PUN || defined USE_LST
+			_sys_devidle(true);
+#endif
 			SET_HIGH_REGISTER(AF, _getcon());
 #ifdef DEBUG
 			if (HIGH_REGISTER(AF) == DEBUGKEY)
@@ -574,19 +606,33 @@ void _Bios(void) {
 			break;
 		}
 		case B_HOME: {		// 8 - Home disk head
+#ifdef DISKIMAGE
+			imgTrack = 0;
+#endif
 			break;
 		}
 		case B_SELDSK: {    // 9 - Select disk drive
 			disk[0] += LOW_REGISTER(BC);
 			HL = 0x0000;
+#ifdef DISKIMAGE
+			imgDisk = LOW_REGISTER(BC);
+			if ((HL = _img_select(imgDisk)))	// Drives with an image get their own DPH
+				break;
+#endif
 			if (_sys_select(&disk[0]))
 				HL = DPHaddr;
 			break;
 		}
 		case B_SETTRK: {    // 10 - Set track number
+#ifdef DISKIMAGE
+			imgTrack = BC;
+#endif
 			break;
 		}
 		case B_SETSEC: {    // 11 - Set sector number
+#ifdef DISKIMAGE
+			imgSector = BC;
+#endif
 			break;
 		}
 		case B_SETDMA: {    // 12 - Set DMA address
@@ -595,11 +641,19 @@ void _Bios(void) {
 			break;
 		}
 		case B_READ: {		// 13 - Read selected sector
+#ifdef DISKIMAGE
+			SET_HIGH_REGISTER(AF, _img_rw(false, 0));
+#else
 			SET_HIGH_REGISTER(AF, 0x00);
+#endif
 			break;
 		}
 		case B_WRITE: {		// 14 - Write selected sector
+#ifdef DISKIMAGE
+			SET_HIGH_REGISTER(AF, _img_rw(true, LOW_REGISTER(BC)));
+#else
 			SET_HIGH_REGISTER(AF, 0x00);
+#endif
 			break;
 		}
 		case B_LISTST: {    // 15 - Get list device status
@@ -607,6 +661,12 @@ void _Bios(void) {
 			break;
 		}
 		case B_SECTRAN: {   // 16 - Sector translate
+#ifdef DISKIMAGE
+			if (DE) {		// Image drives pass their translation table on DE
+				HL = _RamRead(DE + BC);
+				break;
+			}
+#endif
 			HL = BC;		// HL=BC=No translation (1:1)
 			break;
 		}
@@ -638,6 +698,10 @@ void _Bios(void) {
 		}
 		case B_FLUSH: {		// 24 - Write any pending data to disc
 			SET_HIGH_REGISTER(AF, 0x00);
+#ifdef DISKIMAGE
+			if (!_img_flush())
+				SET_HIGH_REGISTER(AF, 0x01);	// Physical error
+#endif
 			break;
 		}
 		case B_MOVE: {		// 25 - Move a block of memory
@@ -665,6 +729,15 @@ void _Bios(void) {
 			break;
 		}
 		case B_USERF: {		// 30 - This allows programs ending in RET return to internal CCP
+#ifdef DISKIMAGE
+			_img_flush();
+#endif
+#ifdef WRITEBEHIND
+			_wb_drain();
+#endif
+#if defined USE_PUN || defined USE_LST
+			_sys_devidle(true);
+#endif
 			Status = 3;
 			break;
 		}
@@ -687,6 +760,20 @@ void _Bios(void) {
 #endif
 } // _Bios
 
+// Puts count chars from the emulated memory at address on the console, a block at a time
+void _putconram(uint16 address, uint16 count) {
+	uint8 buf[128];
+	uint8 i, n;
+
+	while (count) {
+		n = count < sizeof(buf) ? count : sizeof(buf);
+		for (i = 0; i < n; ++i)
+			buf[i] = _RamRead(address++);
+		_putconbuf(buf, n);
+		count -= n;
+	}
+}
+
 void _Bdos(void) {
 	uint8 ch = LOW_REGISTER(BC);
 
@@ -696,6 +783,12 @@ void _Bdos(void) {
 
 	HL = 0x0000;                            // HL is reset by the BDOS
 	SET_LOW_REGISTER(BC, LOW_REGISTER(DE)); // C ends up equal to E
+#ifdef WRITEBEHIND
+	_wb_idle(ch == C_READ || ch == C_READSTR);	// Commits queued writes while the console waits for input
+#endif
+#if defined USE_PUN || defined USE_LST
+	_sys_devidle(ch == C_READ || ch == C_READSTR);	// Same for the PUN: and LST: output
+#endif
 
 	switch (ch) {
 #ifndef ABDOS
@@ -751,7 +844,7 @@ void _Bdos(void) {
 				pun_open = TRUE;
 			}
 			if (pun_dev) {
-				_sys_fputc(LOW_REGISTER(DE), pun_dev);
+				_sys_fputc(LOW_REGISTER(DE), pun_dev, (uint8 *)pun_file);
 			}
 #endif // ifdef USE_PUN
 			break;
@@ -767,7 +860,7 @@ void _Bdos(void) {
 				lst_open = TRUE;
 			}
 			if (lst_dev)
-				_sys_fputc(LOW_REGISTER(DE), lst_dev);
+				_sys_fputc(LOW_REGISTER(DE), lst_dev, (uint8 *)lst_file);
 #endif // ifdef USE_LST
 			break;
 		}
@@ -827,8 +920,16 @@ void _Bdos(void) {
 		   Sends the $ terminated string pointed by (DE) to the screen
 		 */
 		case C_WRITESTR: {
-			while ((ch = _RamRead(DE++)) != '$')
-				_putcon(ch);
+			uint8 buf[128];
+			uint8 n = 0;
+
+			while ((buf[n] = _RamRead(DE++)) != '$') {
+				if (++n == sizeof(buf)) {
+					_putconbuf(buf, n);
+					n = 0;
+				}
+			}
+			_putconbuf(buf, n);
 			break;
 		}
 
@@ -1100,6 +1201,7 @@ void _Bdos(void) {
 			loginVector = 0;
 			dmaAddr = 0x0080;
 			cDrive = 0;         // userCode remains unchanged
+			_sys_diskreset(0xffff);
 			HL = _CheckSUB();   // Checks if there's a $$$.SUB on the boot disk
 			break;
 		}
@@ -1169,8 +1271,9 @@ void _Bdos(void) {
 		/*
 		   C = 20 (14h) : Read sequential
 		   DE = address of FCB
-		   ToDo under CP/M 3 this can be a multiple of 128 bytes
+		   Reads the number of records set by BDOS 44
 		   Returns: A = return code
+		   	    H = Records read if A is not zero and the count is above 1
 		 */
 		case F_READ: {
 			HL = _ReadSeq(DE);
@@ -1180,8 +1283,9 @@ void _Bdos(void) {
 		/*
 		   C = 21 (15h) : Write sequential
 		   DE = address of FCB
-		   ToDo under CP/M 3 this can be a multiple of 128 bytes
+		   Writes the number of records set by BDOS 44
 		   Returns: A=return code
+		   	    H = Records written if A is not zero and the count is above 1
 		   */
 		case F_WRITE: {
 			HL = _WriteSeq(DE);
@@ -1265,6 +1369,10 @@ void _Bdos(void) {
 		 */
 		case DRV_PDB: {
 			HL = DPBaddr;
+#ifdef DISKIMAGE
+			if (_img_select(cDrive))	// Drives with an image have their own DPB
+				HL = _RamRead16(_img_select(cDrive) + 10);
+#endif
 			break;
 		}
 
@@ -1282,6 +1390,7 @@ void _Bdos(void) {
 
 		/*
 		   C = 33 (21h) : Read random
+		   Reads the number of records set by BDOS 44
 		   ToDo under CPM3, if A returns 0xFF, H returns hardware error 
 		 */
 		case F_READRAND: {
@@ -1291,6 +1400,7 @@ void _Bdos(void) {
 
 		/*
 		   C = 34 (22h) : Write random
+		   Writes the number of records set by BDOS 44
 		   ToDo under CPM3, if A returns 0xFF, H returns hardware error 
 		   */
 		case F_WRITERAND: {
@@ -1319,6 +1429,7 @@ void _Bdos(void) {
 		 */
 		case DRV_RESET: {
 			roVector = roVector & ~DE;
+			_sys_diskreset(DE);
 			break;
 		}
 
@@ -1390,11 +1501,16 @@ void _Bdos(void) {
 
 
 		/* 
-		   ToDo: C = 44 (2Ch) : Set number of records to read/write at once (CPM3)
+		   C = 44 (2Ch) : Set number of records to read/write at once (CPM3)
 		   E = Number of Sectors
 		   Returns: A = return code (Returns A=0 if E was valid, 0FFh otherwise)
 		 */
 		case F_MULTISEC: {
+			if (LOW_REGISTER(DE) >= 1 && LOW_REGISTER(DE) <= 128) {
+				multiSec = LOW_REGISTER(DE);
+			} else {
+				HL = 0xff;
+			}
 			break;
 		}
 
@@ -1437,6 +1553,10 @@ void _Bdos(void) {
 		   	    H = Physical Error
 		 */
 		case DRV_FLUSH: {
+#ifdef WRITEBEHIND
+			if (!_wb_flush())
+				HL = 0xff;	// A queued write failed when committed
+#endif
 			break;
 		}
 
@@ -1619,21 +1739,37 @@ void _Bdos(void) {
 
 
 		/* 
-		   ToDo: C = 111 (6Fh) : Print Block (CPM3)
+		   C = 111 (6Fh) : Print Block (CPM3)
 		   DE =  address of CCB
+		   	 CCB: DEFW    address of the chars
+		   	      DEFW    number of chars
 		   Returns: None
 		 */
 		case C_WRITEBLK: {
+			_putconram(_RamRead16(DE), _RamRead16(DE + 2));
 			break;
 		}
 
 
 		/* 
-		   ToDo: C = 112 (70h) : List Block (CPM3)
-		   DE =  address of CCB
+		   C = 112 (70h) : List Block (CPM3)
+		   DE =  address of CCB, as on C = 111
 		   Returns: None
 		 */
 		case L_WRITEBLK: {
+#ifdef USE_LST
+			uint16 address = _RamRead16(DE);
+			uint16 count = _RamRead16(DE + 2);
+
+			if (!lst_open) {
+				lst_dev = _sys_fopen_w((uint8 *)lst_file);
+				lst_open = TRUE;
+			}
+			if (lst_dev) {
+				while (count--)
+					_sys_fputc(_RamRead(address++), lst_dev, (uint8 *)lst_file);
+			}
+#endif // ifdef USE_LST
 			break;
 		}
 
@@ -64,64 +64,99 @@ int _SelectDisk(uint8 dr) {
 	return(result);
 }
 
+// FCB to host name conversion, with the last few conversions kept to skip rebuilding the same names
+#define HOSTNAME_CACHE 4	// Number of conversions kept
+
+typedef struct {
+	uint8 drive;		// Drive letter, 0 if the entry is free
+	uint8 user;			// User folder character
+	uint8 fn[11];		// FCB name and type, as found on the FCB
+	uint8 unique;		// FALSE if the name has wildcards
+	uint8 name[17];		// Host name built from them
+} HOSTNAME_ENTRY;
+
+static HOSTNAME_ENTRY hostnameCache[HOSTNAME_CACHE];
+static uint8 hostnameNext = 0;
+static uint8 hostChar[128];	// Host character for each FCB character, 0 if the character is dropped
+
+// Fills in the FCB to host character table
+void _InitHostChar(void) {
+	uint8 c;
+
+	for (c = 0; c < 128; ++c)
+		hostChar[c] = c > 32 ? toupper(c) : 0;
+#ifdef NOSLASH
+	hostChar['/'] = '_';
+#endif
+}
+
 // Converts a FCB entry onto a host OS filename string
 uint8 _FCBtoHostname(uint16 fcbaddr, uint8* filename) {
 	uint8 addDot = TRUE;
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
+	HOSTNAME_ENTRY* h;
+	uint8* p = filename;
+	uint8 drive = (F->dr && F->dr != '?') ? (F->dr - 1) + 'A' : cDrive + 'A';
+	uint8 user = toupper(tohex(userCode));
 	uint8 i = 0;
 	uint8 unique = TRUE;
 	uint8 c;
 
-	if (F->dr && F->dr != '?') {
-		*(filename++) = (F->dr - 1) + 'A';
-	} else {
-		*(filename++) = cDrive + 'A';
+	if (F->dr != '?') {
+		for (i = 0; i < HOSTNAME_CACHE; ++i) {
+			h = &hostnameCache[i];
+			if (h->drive == drive && h->user == user && !memcmp(h->fn, F->fn, 11)) {
+				memcpy(filename, h->name, sizeof(h->name));
+				return(h->unique);
+			}
+		}
 	}
-	*(filename++) = FOLDERCHAR;
+	if (!hostChar['A'])
+		_InitHostChar();
 
-	*(filename++) = toupper(tohex(userCode));
-	*(filename++) = FOLDERCHAR;
+	*(p++) = drive;
+	*(p++) = FOLDERCHAR;
+	*(p++) = user;
+	*(p++) = FOLDERCHAR;
 
 	if (F->dr != '?') {
-		while (i < 8) {
-			c = F->fn[i] & 0x7F;
-#ifdef NOSLASH
-			if (c == '/')
-				c = '_';
-#endif
-			if (c > 32)
-				*(filename++) = toupper(c);
+		for (i = 0; i < 8; ++i) {
+			c = hostChar[F->fn[i] & 0x7F];
+			if (c)
+				*(p++) = c;
 			if (c == '?')
 				unique = FALSE;
-			++i;
 		}
-		i = 0;
-		while (i < 3) {
-			c = F->tp[i] & 0x7F;
-			if (c > 32) {
+		for (i = 0; i < 3; ++i) {
+			c = hostChar[F->tp[i] & 0x7F];
+			if (c) {
 				if (addDot) {
 					addDot = FALSE;
-					*(filename++) = '.';  // Only add the dot if there's an extension
+					*(p++) = '.';  // Only add the dot if there's an extension
 				}
-#ifdef NOSLASH
-				if (c == '/')
-					c = '_';
-#endif
-				*(filename++) = toupper(c);
+				*(p++) = c;
 			}
 			if (c == '?')
 				unique = FALSE;
-			++i;
 		}
+		*p = 0x00;
+
+		h = &hostnameCache[hostnameNext];
+		hostnameNext = (hostnameNext + 1) % HOSTNAME_CACHE;
+		h->drive = drive;
+		h->user = user;
+		memcpy(h->fn, F->fn, 11);
+		h->unique = unique;
+		memcpy(h->name, filename, sizeof(h->name));
 	} else {
 		for (i = 0; i < 8; ++i)
-			*(filename++) = '?';
-		*(filename++) = '.';
+			*(p++) = '?';
+		*(p++) = '.';
 		for (i = 0; i < 3; ++i)
-			*(filename++) = '?';
+			*(p++) = '?';
+		*p = 0x00;
 		unique = FALSE;
 	}
-	*filename = 0x00;
 
 	return(unique);
 }
@@ -194,6 +229,19 @@ void _HostnameToFCBname(uint8* from, uint8* to) {
 	*to = 0;
 }
 
+// Converts a FCB name (AB      TXT) onto a string name (AB.TXT)
+void _FCBnameToHostname(uint8* from, uint8* to) {
+	uint8 i;
+
+	for (i = 0; i < 8 && from[i] != ' '; ++i)
+		*(to++) = from[i];
+	if (from[8] != ' ')
+		*(to++) = '.';
+	for (i = 8; i < 11 && from[i] != ' '; ++i)
+		*(to++) = from[i];
+	*to = 0;
+}
+
 // Creates a fake directory entry for the current dmaAddr FCB
 void _mockupDirEntry(uint8 mode) {
 	CPM_DIRENTRY* DirEntry = (CPM_DIRENTRY*)_RamSysAddr(dmaAddr);
@@ -293,9 +341,9 @@ uint8 _OpenFile(uint16 fcbaddr) {
 		_FCBtoHostname(fcbaddr, &filename[0]);
 		if (!filename[4])
 			return(0xff);	// Invalid filename
-		if (_sys_openfile(&filename[0])) {
+		if (_sys_openfile(&filename[0], &len)) {
 
-			len = _FileSize(fcbaddr) / BlkSZ;	// Compute the len on the file in blocks
+			len = (len + BlkSZ - 1) / BlkSZ;	// Compute the len on the file in blocks
 
 			F->s1 = 0x00;
 			F->s2 = 0x80;	// set unmodified flag
@@ -322,9 +370,13 @@ uint8 _CloseFile(uint16 fcbaddr) {
 				_FCBtoHostname(fcbaddr, &filename[0]);
 				if (!filename[4])
 					return(0xff);	// Invalid filename
+				result = 0x00;
+#ifdef WRITEBEHIND
+				if (!_wb_close(&filename[0]))
+					result = 0xff;	// Queued writes to it failed when committed
+#endif
 				if (fcbaddr == BatchFCB)
 					_Truncate((char*)filename, F->rc);	// Truncate $$$.SUB to F->rc CP/M records so SUBMIT.COM can work
-				result = 0x00;
 			} else {
 				_error(errWRITEPROT);
 			}
@@ -399,38 +451,50 @@ uint8 _SearchNext(uint16 fcbaddr, uint8 isdir) {
 }
 
 // Deletes a file
+#define DELBATCH 128	// Number of matches collected before they are deleted
+static uint8 delNames[DELBATCH][11];
+
 uint8 _DeleteFile(uint16 fcbaddr) {
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
-#if defined(USE_PUN) || defined(USE_LST)
 	CPM_FCB* T = (CPM_FCB*)_RamSysAddr(tmpFCB);
-#endif
 	uint8 result = 0xff;
 	uint8 deleted = 0xff;
+	uint16 count, i;
 
 	if (!_SelectDisk(F->dr)) {
 		if (!RW) {
 			result = _SearchFirst(fcbaddr, FALSE);	// FALSE = Does not create a fake dir entry when finding the file
 			while (result != 0xff) {
-#ifdef USE_PUN
-				if (!strcmp((char*)T->fn, "PUN     TXT") && pun_open) {
-					_sys_fclose(pun_dev);
-					pun_open = FALSE;
+				// Collects the matches first, as deleting a file would restart the search
+				count = 0;
+				while (result != 0xff && count < DELBATCH) {
+					memcpy(delNames[count++], T->fn, 11);
+					result = _SearchNext(fcbaddr, FALSE);
 				}
+				for (i = 0; i < count; ++i) {
+#ifdef USE_PUN
+					if (!memcmp(delNames[i], "PUN     TXT", 11) && pun_open) {
+						_sys_fclose(pun_dev);
+						pun_open = FALSE;
+					}
 #endif
 #ifdef USE_LST
-				if (!strcmp((char*)T->fn, "LST     TXT") && lst_open) {
-					_sys_fclose(lst_dev);
-					lst_open = FALSE;
-				}
+					if (!memcmp(delNames[i], "LST     TXT", 11) && lst_open) {
+						_sys_fclose(lst_dev);
+						lst_open = FALSE;
+					}
 #endif
-				_FCBtoHostname(tmpFCB, &filename[0]);
-				if (_sys_deletefile(&filename[0])) {
-					deleted = 0x00;
-				} else {
-					_error(errWRITEPROT);
-					break;
+					memcpy(T->fn, delNames[i], 11);
+					_FCBtoHostname(tmpFCB, &filename[0]);
+					if (_sys_deletefile(&filename[0])) {
+						deleted = 0x00;
+					} else {
+						_error(errWRITEPROT);
+						return(deleted);
+					}
 				}
-				result = _SearchFirst(fcbaddr, FALSE);	// FALSE = Does not create a fake dir entry when finding the file
+				if (count == DELBATCH)	// The batch was full, looks for what is left
+					result = _SearchFirst(fcbaddr, FALSE);
 			}
 		} else {
 			_error(errWRITEPROT);
@@ -462,10 +526,43 @@ uint8 _RenameFile(uint16 fcbaddr) {
 	return(result);
 }
 
+// Advances the FCB sequential position by one record
+void _SeqAdvance(CPM_FCB* F) {
+	++F->cr;
+	if (F->cr > MaxCR) {
+		F->cr = 1;
+		++F->ex;
+	}
+	if (F->ex > MaxEX) {
+		F->ex = 0;
+		++F->s2;
+	}
+}
+
+// Returns the number of records the next read/write call moves, as set by BDOS 44
+// The count is reduced if the DMA buffer would go past the top of memory
+uint8 _MultiCount(void) {
+	uint32 room = (0x10000L - dmaAddr) / BlkSZ;
+
+	if (room < 1)
+		return(1);
+	return(multiSec > room ? (uint8)room : multiSec);
+}
+
+// Adds the number of records moved to the return code of a failed multi-sector transfer
+// CP/M 3 returns it in H, which ends up in B
+uint16 _MultiResult(uint8 result, uint8 recs) {
+	if (result && multiSec > 1)
+		return((recs << 8) | result);
+	return(result);
+}
+
 // Sequential read
-uint8 _ReadSeq(uint16 fcbaddr) {
+uint16 _ReadSeq(uint16 fcbaddr) {
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
 	uint8 result = 0xff;
+	uint8 recs = _MultiCount();
+	uint8 i;
 
 	long fpos = ((F->s2 & MaxS2) * BlkS2 * BlkSZ) +
 		(F->ex * BlkEX * BlkSZ) +
@@ -473,28 +570,45 @@ uint8 _ReadSeq(uint16 fcbaddr) {
 
 	if (!_SelectDisk(F->dr)) {
 		_FCBtoHostname(fcbaddr, &filename[0]);
-		result = _sys_readseq(&filename[0], fpos);
-		if (!result) {	// Read succeeded, adjust FCB
-			++F->cr;
-			if (F->cr > MaxCR) {
-				F->cr = 1;
-				++F->ex;
-			}
-			if (F->ex > MaxEX) {
-				F->ex = 0;
-				++F->s2;
-			}
+		result = _sys_readseq(&filename[0], fpos, &recs);
+		for (i = 0; i < recs; ++i)	// Adjust FCB for the records read
+			_SeqAdvance(F);
+		if (!result) {
 			if ((F->s2 & 0x7F) > MaxS2)
 				result = 0xfe;	// (todo) not sure what to do 
 		}
+	} else {
+		recs = 0;
 	}
-	return(result);
+	return(_MultiResult(result, recs));
+}
+
+// Loads an open file into memory from address up to limit in a single host read
+// Leaves the FCB as the equivalent series of sequential reads would. Returns the number of records loaded
+uint16 _LoadFile(uint16 fcbaddr, uint16 address, uint16 limit) {
+	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
+	uint16 recs = 0;
+	uint16 i;
+
+	long fpos = ((F->s2 & MaxS2) * BlkS2 * BlkSZ) +
+		(F->ex * BlkEX * BlkSZ) +
+		(F->cr * BlkSZ);
+
+	if (!_SelectDisk(F->dr)) {
+		_FCBtoHostname(fcbaddr, &filename[0]);
+		recs = _sys_loadfile(&filename[0], fpos, address, limit);
+		for (i = 0; i < recs; ++i)
+			_SeqAdvance(F);
+	}
+	return(recs);
 }
 
 // Sequential write
-uint8 _WriteSeq(uint16 fcbaddr) {
+uint16 _WriteSeq(uint16 fcbaddr) {
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
 	uint8 result = 0xff;
+	uint8 recs = _MultiCount();
+	uint8 i;
 
 	long fpos = ((F->s2 & MaxS2) * BlkS2 * BlkSZ) +
 		(F->ex * BlkEX * BlkSZ) +
@@ -503,40 +617,40 @@ uint8 _WriteSeq(uint16 fcbaddr) {
 	if (!_SelectDisk(F->dr)) {
 		if (!RW) {
 			_FCBtoHostname(fcbaddr, &filename[0]);
-			result = _sys_writeseq(&filename[0], fpos);
-			if (!result) {	// Write succeeded, adjust FCB
+			result = _sys_writeseq(&filename[0], fpos, &recs);
+			if (recs) {	// Adjust FCB for the records written
 				F->s2 &= 0x7F;		// reset unmodified flag
-				++F->cr;
-				if (F->cr > MaxCR) {
-					F->cr = 1;
-					++F->ex;
+				for (i = 0; i < recs; ++i) {
+					_SeqAdvance(F);
+					++F->rc;
 				}
-				if (F->ex > MaxEX) {
-					F->ex = 0;
-					++F->s2;
-				}
-				++F->rc;
-				if (F->s2 > MaxS2)
+				if (!result && F->s2 > MaxS2)
 					result = 0xfe;	// (todo) not sure what to do 
 			}
 		} else {
+			recs = 0;
 			_error(errWRITEPROT);
 		}
+	} else {
+		recs = 0;
 	}
-	return(result);
+	return(_MultiResult(result, recs));
 }
 
 // Random read
-uint8 _ReadRand(uint16 fcbaddr) {
+uint16 _ReadRand(uint16 fcbaddr) {
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
 	uint8 result = 0xff;
+	uint8 recs = _MultiCount();
 
 	int32 record = (F->r2 << 16) | (F->r1 << 8) | F->r0;
 	long fpos = record * BlkSZ;
 
 	if (!_SelectDisk(F->dr)) {
 		_FCBtoHostname(fcbaddr, &filename[0]);
-		result = _sys_readrand(&filename[0], fpos);
+		result = _sys_readrand(&filename[0], fpos, &recs);
+		if (recs > 1)	// The FCB is left at the last record read, the random record is kept
+			record += recs - 1;
 		if (result == 0 || result == 1 || result == 4) {
 			// adjust FCB unless error #6 (seek past 8MB - max CP/M file & disk size)
 			F->cr = record & 0x7F;
@@ -547,14 +661,17 @@ uint8 _ReadRand(uint16 fcbaddr) {
 				F->s2 = (record >> 12) & MaxS2;
 			}
 		}
+	} else {
+		recs = 0;
 	}
-	return(result);
+	return(_MultiResult(result, recs));
 }
 
 // Random write
-uint8 _WriteRand(uint16 fcbaddr) {
+uint16 _WriteRand(uint16 fcbaddr) {
 	CPM_FCB* F = (CPM_FCB*)_RamSysAddr(fcbaddr);
 	uint8 result = 0xff;
+	uint8 recs = _MultiCount();
 
 	int32 record = (F->r2 << 16) | (F->r1 << 8) | F->r0;
 	long fpos = record * BlkSZ;
@@ -562,17 +679,21 @@ uint8 _WriteRand(uint16 fcbaddr) {
 	if (!_SelectDisk(F->dr)) {
 		if (!RW) {
 			_FCBtoHostname(fcbaddr, &filename[0]);
-			result = _sys_writerand(&filename[0], fpos);
-			if (!result) {	// Write succeeded, adjust FCB
+			result = _sys_writerand(&filename[0], fpos, &recs);
+			if (recs) {	// Adjust FCB to the last record written, the random record is kept
+				record += recs - 1;
 				F->cr = record & 0x7F;
 				F->ex = (record >> 7) & 0x1f;
 				F->s2 = (record >> 12) & MaxS2;	// resets unmodified flag
 			}
 		} else {
+			recs = 0;
 			_error(errWRITEPROT);
 		}
+	} else {
+		recs = 0;
 	}
-	return(result);
+	return(_MultiResult(result, recs));
 }
 
 // Returns the size of a CP/M file
@@ -0,0 +1,250 @@
+#ifndef DISKIMAGE_H
+#define DISKIMAGE_H
+
+/* Disk images, raw BIOS track/sector I/O on drives that have an image file */
+/*===============================================================================*/
+// Drive X is backed by X.DSK on the card root, its format is told by the image size
+// The tables of an image drive (DPB, sector translation, DPH, CSV and ALV) are built on IMGaddr on its first select
+// Sectors go through a small write back cache of card sized blocks, written on BIOS FLUSH, on directory writes
+// and when a program ends
+
+#define IMG_CACHE 4			// Blocks kept in the cache
+#define IMG_BLOCK 512		// Bytes on each block
+
+typedef struct {
+	uint32 size;		// Image size in bytes
+	uint16 spt;			// 128 byte sectors per track
+	uint8 bsh;			// DPB fields
+	uint8 blm;
+	uint8 exm;
+	uint16 dsm;
+	uint16 drm;
+	uint8 al0;
+	uint8 al1;
+	uint16 cks;
+	uint16 off;
+	const uint8* xlt;	// Sector translation table (sectors starting at 1), NULL if none (sectors starting at 0)
+} IMG_FORMAT;
+
+static const uint8 imgSkew26[26] = { 1, 7, 13, 19, 25, 5, 11, 17, 23, 3, 9, 15, 21, 2, 8, 14, 20, 26, 6, 12, 18, 24, 4, 10, 16, 22 };
+
+static const IMG_FORMAT imgFormats[] = {
+	{ 256256,	26,		3, 7,	0, 242,		63,		0xC0, 0x00, 16,	2, imgSkew26 },	// 8" SSSD, IBM 3740
+	{ 4177920,	128,	4, 15,	0, 2039,	1023,	0xFF, 0xFF, 0,	0, NULL },		// 4MB hard disk, z80pack
+	{ 8404992,	64,		5, 31,	1, 2047,	1023,	0xFF, 0x00, 0,	2, NULL },		// 8MB hard disk, same layout as the RunCPM drives
+};
+
+typedef struct {
+	File32 file;
+	const IMG_FORMAT* fmt;
+	uint16 dph;			// Address of its DPH, 0 if the drive has no image
+	bool ro;			// Image could only be opened for reading
+} IMG_DRIVE;
+
+typedef struct {
+	uint8 drive;		// Drive the block belongs to, 0xff if the slot is free
+	bool dirty;			// Block has to be written back
+	uint16 len;			// Bytes of the image on this block
+	uint32 block;		// Block number on the image
+	uint32 used;		// Last use, the slot used longest ago is the one reused
+	uint8 data[IMG_BLOCK];
+} IMG_SLOT;
+
+static IMG_DRIVE imgDrive[16];
+static IMG_SLOT imgCache[IMG_CACHE];
+static uint16 imgChecked = 0;			// Drives already looked for an image
+static uint16 imgFree = IMGaddr + 128;	// Next free byte of the tables area, the first 128 bytes are the directory buffer
+static uint32 imgTick = 0;
+static uint8 imgDisk = 0;				// Drive selected by BIOS SELDSK
+static uint16 imgTrack = 0;				// Track set by BIOS SETTRK
+static uint16 imgSector = 0;			// Sector set by BIOS SETSEC
+
+// Writes a changed block back, it stays changed if that fails so a later write back can try again
+bool _img_writeback(IMG_SLOT* s) {
+	File32* f = &imgDrive[s->drive].file;
+	bool result = true;
+
+	if (s->dirty) {
+		digitalWrite(LED, HIGH ^ LEDinv);
+		result = f->seek(s->block * IMG_BLOCK) && f->write(s->data, s->len) == s->len;
+		result = f->sync() && result;
+		digitalWrite(LED, LOW ^ LEDinv);
+		if (result)
+			s->dirty = false;
+	}
+	return(result);
+}
+
+// Writes back every changed block, returns false if any of them could not be written
+bool _img_flush(void) {
+	bool result = true;
+	uint8 i;
+
+	for (i = 0; i < IMG_CACHE; ++i) {
+		if (!_img_writeback(&imgCache[i]))
+			result = false;
+	}
+	return(result);
+}
+
+// Writes back the cache, closes the images and frees the tables area, drives are looked for again on their next select
+void _img_reset(void) {
+	uint8 i;
+
+	_img_flush();
+	for (i = 0; i < IMG_CACHE; ++i)
+		imgCache[i].drive = 0xff;
+	for (i = 0; i < 16; ++i) {
+		if (imgDrive[i].dph)
+			imgDrive[i].file.close();
+		imgDrive[i].dph = 0;
+	}
+	imgChecked = 0;
+	imgFree = IMGaddr + 128;
+}
+
+// Opens X.DSK and builds the drive tables, leaves dph at 0 if there is no usable image
+void _img_mount(uint8 drive) {
+	IMG_DRIVE* d = &imgDrive[drive];
+	const IMG_FORMAT* fmt = NULL;
+	char name[] = "A.DSK";
+	uint16 xlt, dpb, csv, alv, i;
+	uint32 size;
+
+	name[0] += drive;
+	digitalWrite(LED, HIGH ^ LEDinv);
+	d->ro = false;
+	if (!(d->file = SD.open(name, O_RDWR))) {
+		d->ro = true;
+		d->file = SD.open(name, O_READ);
+	}
+	digitalWrite(LED, LOW ^ LEDinv);
+	if (!d->file)
+		return;
+	size = d->file.size();
+	for (i = 0; i < sizeof(imgFormats) / sizeof(IMG_FORMAT); ++i) {
+		if (imgFormats[i].size == size)
+			fmt = &imgFormats[i];
+	}
+	if (!fmt || imgFree + 15 + (fmt->xlt ? fmt->spt : 0) + 16 + fmt->cks + fmt->dsm / 8 + 1 > IMGaddr + DISKIMAGE_AREA) {
+		d->file.close();
+		return;
+	}
+
+	dpb = imgFree;
+	_RamWrite16(dpb, fmt->spt);
+	_RamWrite(dpb + 2, fmt->bsh);
+	_RamWrite(dpb + 3, fmt->blm);
+	_RamWrite(dpb + 4, fmt->exm);
+	_RamWrite16(dpb + 5, fmt->dsm);
+	_RamWrite16(dpb + 7, fmt->drm);
+	_RamWrite(dpb + 9, fmt->al0);
+	_RamWrite(dpb + 10, fmt->al1);
+	_RamWrite16(dpb + 11, fmt->cks);
+	_RamWrite16(dpb + 13, fmt->off);
+	xlt = 0;
+	imgFree += 15;
+	if (fmt->xlt) {
+		xlt = imgFree;
+		for (i = 0; i < fmt->spt; ++i)
+			_RamWrite(xlt + i, fmt->xlt[i]);
+		imgFree += fmt->spt;
+	}
+	d->dph = imgFree;
+	imgFree += 16;
+	csv = imgFree;
+	imgFree += fmt->cks;
+	alv = imgFree;
+	imgFree += fmt->dsm / 8 + 1;
+	for (i = csv; i < imgFree; ++i)
+		_RamWrite(i, 0);
+
+	_RamWrite16(d->dph, xlt);		// Sector translation table
+	_RamWrite16(d->dph + 2, 0);		// Workspace
+	_RamWrite16(d->dph + 4, 0);
+	_RamWrite16(d->dph + 6, 0);
+	_RamWrite16(d->dph + 8, IMGaddr);	// Directory buffer, shared by all image drives
+	_RamWrite16(d->dph + 10, dpb);
+	_RamWrite16(d->dph + 12, csv);
+	_RamWrite16(d->dph + 14, alv);
+	d->fmt = fmt;
+}
+
+// Returns the DPH of a drive backed by an image, 0 if the drive has no image
+uint16 _img_select(uint8 drive) {
+	if (drive >= 16)
+		return(0);
+	if (!(imgChecked & (1 << drive))) {
+		imgChecked |= 1 << drive;
+		_img_mount(drive);
+	}
+	return(imgDrive[drive].dph);
+}
+
+// Returns the cache slot holding a block of an image, reading it in if needed
+IMG_SLOT* _img_block(uint8 drive, uint32 block) {
+	IMG_SLOT* s = &imgCache[0];
+	File32* f = &imgDrive[drive].file;
+	uint32 len;
+	uint8 i;
+
+	for (i = 0; i < IMG_CACHE; ++i) {
+		if (imgCache[i].drive == drive && imgCache[i].block == block) {
+			imgCache[i].used = ++imgTick;
+			return(&imgCache[i]);
+		}
+		if (s->drive != 0xff && (imgCache[i].drive == 0xff || imgCache[i].used < s->used))
+			s = &imgCache[i];
+	}
+	if (s->drive != 0xff && !_img_writeback(s))
+		return(NULL);
+	s->drive = 0xff;
+	len = imgDrive[drive].fmt->size - block * IMG_BLOCK;
+	if (len > IMG_BLOCK)
+		len = IMG_BLOCK;
+	digitalWrite(LED, HIGH ^ LEDinv);
+	if (!f->seek(block * IMG_BLOCK) || f->read(s->data, len) != (int)len) {
+		digitalWrite(LED, LOW ^ LEDinv);
+		return(NULL);
+	}
+	digitalWrite(LED, LOW ^ LEDinv);
+	s->drive = drive;
+	s->block = block;
+	s->len = len;
+	s->dirty = false;
+	s->used = ++imgTick;
+	return(s);
+}
+
+// Moves the sector set by SETTRK/SETSEC from or to the DMA buffer, returns the BIOS result
+// type is the BIOS WRITE type, 1 for directory writes, which are written back at once
+uint8 _img_rw(bool write, uint8 type) {
+	IMG_DRIVE* d = &imgDrive[imgDisk];
+	IMG_SLOT* s;
+	uint16 sector;
+	uint32 offset;
+
+	if (imgDisk >= 16 || !d->dph)
+		return(1);
+	sector = imgSector - (d->fmt->xlt ? 1 : 0);
+	if (sector >= d->fmt->spt)
+		return(1);
+	offset = ((uint32)imgTrack * d->fmt->spt + sector) * BlkSZ;
+	if (offset + BlkSZ > d->fmt->size)
+		return(1);
+	if (write && d->ro)
+		return(2);	// Read only
+	if (!(s = _img_block(imgDisk, offset / IMG_BLOCK)))
+		return(1);
+	if (write) {
+		memcpy(&s->data[offset % IMG_BLOCK], _RamSysAddr(dmaAddr), BlkSZ);
+		s->dirty = true;
+		if (type == 1 && !_img_writeback(s))
+			return(1);
+	} else {
+		memcpy(_RamSysAddr(dmaAddr), &s->data[offset % IMG_BLOCK], BlkSZ);
+	}
+	return(0);
+}
+
+#endif
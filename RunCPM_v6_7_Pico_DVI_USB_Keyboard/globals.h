@@ -17,6 +17,16 @@
 #define USE_PUN	// The pun.txt and lst.txt files will appear on drive A: user 0
 #define USE_LST
 
+/* Definitions for the serial console */
+//#define SERIAL_TXRING 4096	// Console output to Serial1 goes through a ring of this many bytes (a power of two, 256 to 32768),
+							// sent to the UART by its interrupt (by a timer without SERIAL_RXRING), so the emulator and the
+							// display do not wait on the line
+#define SERIAL_TXFULL 0		// When the ring is full: 0 waits for room, 1 drops the new bytes, 2 drops the oldest ones
+//#define SERIAL_RXRING 4096	// Console input from Serial1 is received into a ring of this many bytes (a power of two,
+							// 1024 to 32768) by the UART interrupt, so pasted text is not lost while the emulator is busy
+#define SERIAL_FLOW 1		// Flow control of the receive ring: 0 none, 1 XON/XOFF, 2 RTS on GP22 (see serialrx.h)
+#define SERIALSPD 115200	// Serial1 speed, the UART runs up to 921600 and beyond with a capable adapter
+
 /* Definitions for file/console based debugging */
 //#define DEBUG				// Enables the internal debugger (enabled by default on vstudio debug builds)
 //#define DEBUGONHALT		// Enables the internal debugger when the CPU halts
@@ -130,6 +140,23 @@
 //#define PROFILE					// For measuring time taken to run a CP/M command
 									// This should be enabled only for debugging purposes when trying to improve emulation speed
 
+//#define RAMDISK 'M'				// Keeps this drive in memory instead of on the card, for temporary files
+									// Its contents are lost when the board is reset
+#define RAMDISK_SIZE 32768			// Bytes of memory used by the RAM drive
+
+//#define ROMDISK 'P'				// Serves this drive, read only, from an image packed by tools/romdisk_pack.py
+#define ROMDISK_FILE "ROMDISK.IMG"	// Image file on the card root
+//#define ROMDISK_FLASH				// Links the image into flash from romdisk_image.h instead of reading ROMDISK_FILE
+
+//#define DISKIMAGE					// Serves BIOS track/sector I/O on each drive that has a disk image X.DSK on the card root
+									// For disk utilities and BDOS replacements, the BDOS file calls still use the drive folder
+#define DISKIMAGE_AREA 1024			// Bytes taken from the top of the TPA for the image drives tables (DPH, DPB, ALV, CSV)
+
+//#define WRITEBEHIND				// Queues file writes in memory and commits them to the card later on, in bigger writes
+									// Errors found when committing can not be reported to the program that wrote
+#define WRITEBEHIND_SIZE 8192		// Bytes of memory used by the queue
+#define WRITEBEHIND_DELAY 250		// Milliseconds a write may stay on the queue while programs keep running
+
 #define NOHIGHUSER					// Prevents the creation of user folders above 'F' (15) by programs
 									// Original CP/M BDOS allows it, but I prefer to keep the folders clean
 
@@ -139,6 +166,8 @@
 //#define BATCH0					// If this is defined, the $$$.SUB file will be looked for on user area 0
 									// The default behavior of DRI's CP/M 2.2 was to have $$$.SUB created on the current drive/user while looking for it
 									// on drive A: current user, which made it complicated to run SUBMITs when not logged to drive A: user 0
+//#define SUBMIT_PERSIST			// The internal CCP runs .SUB files from memory, if this is defined the lines still waiting to run
+									// are written to $$$.SUB on the first warm boot of a batch, for programs which look at or change it
 
 /* Some environment and type definitions */
 
@@ -214,13 +243,23 @@ static uint8 ioBank = 1;			// Destination bank for sector IO
 #define BIOSjmppage	(PAGESIZE - 512)
 #define BIOSpage	(BIOSjmppage + 256)
 
+// Image drives tables, right below the BIOS
+#ifdef DISKIMAGE
+	#define IMGaddr (BIOSjmppage - DISKIMAGE_AREA)
+#else
+	#define IMGaddr BIOSjmppage
+#endif
+
 // BDOS Pages (depends on TPASIZE for external CCPs)
 #if defined CCP_INTERNAL
-	#define BDOSjmppage (BIOSjmppage - 256)
+	#define BDOSjmppage (IMGaddr - 256)
 	#define BDOSpage (BDOSjmppage + 16)
 #else
 	#define BDOSjmppage (TPASIZE * 1024) - 1024
 	#define BDOSpage	(BDOSjmppage + 256)
+	#if defined DISKIMAGE && (TPASIZE * 1024) > IMGaddr
+		#error DISKIMAGE_AREA does not fit between the BDOS and the BIOS, lower TPASIZE
+	#endif
 #endif
 
 #define DPBaddr (BIOSpage + 128)	// Address of the Disk Parameter Block (Hardcoded in BIOS)
@@ -240,6 +279,7 @@ static uint8	newname[17];		// New filename in host filesystem format
 static uint8	fcbname[13];		// Current filename in CP/M format
 static uint8	pattern[13];		// File matching pattern in CP/M format
 static uint16	dmaAddr = 0x0080;	// Current dmaAddr
+static uint8	multiSec = 1;		// Number of records moved on each read/write call (BDOS 44)
 static uint8	oDrive = 0;			// Old selected drive
 static uint8	cDrive = 0;			// Currently selected drive
 static uint8	userCode = 0;		// Current user code
@@ -291,6 +331,7 @@ extern "C"
 
 	extern void _HostnameToFCB(uint16 fcbaddr, uint8* filename);
 	extern void _HostnameToFCBname(uint8* from, uint8* to);
+	extern void _FCBnameToHostname(uint8* from, uint8* to);
 	extern void _mockupDirEntry(uint8 mode);
 	extern uint8 match(uint8* fcbname, uint8* pattern);
 
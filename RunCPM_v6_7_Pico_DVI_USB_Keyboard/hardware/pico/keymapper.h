@@ -0,0 +1,88 @@
+#pragma once
+
+#define FLAG_ALPHABETIC (1)
+#define FLAG_SHIFT (2)
+#define FLAG_NUMLOCK (4)
+#define FLAG_CTRL (8)
+#define FLAG_LUT (16)
+
+struct keycode_mapper {
+  uint8_t first, last, code, flags;
+};
+
+#include "keymapperUS.h"
+#include "keymapperJP.h"
+
+// Keyboard layouts. Their mapper lists are compiled into keymap_table when the keyboard starts, so a key press is
+// translated with a single load from the table of the layout in use and the modifiers held
+#define KEYMAP_US 0
+#define KEYMAP_JP 1
+#define KEYMAP_LAYOUTS 2
+
+#ifndef KEYMAP_DEFAULT
+#define KEYMAP_DEFAULT KEYMAP_US	// layout used at power up, Ctrl+Alt+F12 switches to the next one
+#endif
+
+#define KEYSTATE_SHIFT (1)		// modifier state, selects the table of a layout
+#define KEYSTATE_CAPS (2)
+#define KEYSTATE_CTRL (4)
+#define KEYSTATE_NUM (8)
+#define KEYSTATES (16)
+
+#define KEY_NONE 0xff			// keycode with no char in this state
+
+struct keymap_layout {
+  const keycode_mapper *map;
+  uint8_t count;
+  const char * const *lut;
+  bool caps_shift;			// caps lock toggles only with shift held, as printed on JP keyboards
+};
+
+const keymap_layout keymap_layouts[KEYMAP_LAYOUTS] = {
+  { keycode_to_asciiUS, sizeof(keycode_to_asciiUS) / sizeof(keycode_mapper), lutUS, false, },
+  { keycode_to_asciiJP, sizeof(keycode_to_asciiJP) / sizeof(keycode_mapper), lutJP, true, },
+};
+
+uint8_t keymap_table[KEYMAP_LAYOUTS][KEYSTATES][256];
+volatile uint8_t keymap_layout_in_use = KEYMAP_DEFAULT;
+
+// char for keycode in a modifier state, from the first mapper that takes it
+uint8_t keymap_translate(const keymap_layout &layout, uint8_t keycode, uint8_t state) {
+  bool shift = state & KEYSTATE_SHIFT;
+  bool caps = state & KEYSTATE_CAPS;
+  bool ctrl = state & KEYSTATE_CTRL;
+  bool num = state & KEYSTATE_NUM;
+  uint8_t code;
+
+  for (int i = 0; i < layout.count; i++) {
+    const keycode_mapper &mapper = layout.map[i];
+    if (!(keycode >= mapper.first && keycode <= mapper.last))
+      continue;
+    if (mapper.flags & FLAG_SHIFT && !shift)
+      continue;
+    if (mapper.flags & FLAG_NUMLOCK && !num)
+      continue;
+    if (mapper.flags & FLAG_CTRL && !ctrl)
+      continue;
+    if (mapper.flags & FLAG_LUT) {
+      code = layout.lut[mapper.code][keycode - mapper.first];
+    } else {
+      code = keycode - mapper.first + mapper.code;
+    }
+    if (mapper.flags & FLAG_ALPHABETIC) {
+      if (shift ^ caps) {
+        code ^= ('a' ^ 'A');
+      }
+    }
+    if (ctrl) code &= 0x1f;
+    return code;
+  }
+  return KEY_NONE;
+}
+
+void keymap_build(void) {
+  for (int l = 0; l < KEYMAP_LAYOUTS; l++)
+    for (int s = 0; s < KEYSTATES; s++)
+      for (int k = 0; k < 256; k++)
+        keymap_table[l][s][k] = keymap_translate(keymap_layouts[l], k, s);
+}
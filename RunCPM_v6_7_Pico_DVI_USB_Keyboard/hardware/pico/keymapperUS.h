@@ -1,12 +1,6 @@
 #pragma once
 
-#define FLAG_ALPHABETIC (1)
-#define FLAG_SHIFT (2)
-#define FLAG_NUMLOCK (4)
-#define FLAG_CTRL (8)
-#define FLAG_LUT (16)
-
-const char * const lut[] = {
+const char * const lutUS[] = {
   "!@#$%^&*()",                                        /* 0 - shifted numeric keys */
   "\r\x1b\b\t -=[]\\#;'`,./",                          /* 1 - symbol keys */
   "\n\x1b\x7f\t _+{}|~:\"~<>?",                        /* 2 - shifted */
@@ -15,9 +9,7 @@ const char * const lut[] = {
 //"/*-+\n\xff\x1f\xff\x1d\xff\x1b\xff\x1e\xff\xff.",   /* 5 - keypad w/o numlock */
 };
 
-struct keycode_mapper {
-  uint8_t first, last, code, flags;
-} keycode_to_ascii[] = {
+const keycode_mapper keycode_to_asciiUS[] = {
   { HID_KEY_A, HID_KEY_Z, 'a', FLAG_ALPHABETIC, },
 
   { HID_KEY_1, HID_KEY_9, 0, FLAG_SHIFT | FLAG_LUT, },
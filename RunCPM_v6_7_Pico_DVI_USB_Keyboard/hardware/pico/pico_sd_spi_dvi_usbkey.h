@@ -7,10 +7,11 @@
 #include <SdFat.h>
 #include <PicoDVI.h>
 #include <Adafruit_TinyUSB.h>
+#include <hardware/sync.h>
 #include "../../console.h"
 #include "../../arduino_hooks.h"
 
-#include "keymapperUS.h"
+#include "keymapper.h"
 
 #define USE_DISPLAY (1)
 #define USE_KEYBOARD (1)
@@ -43,38 +44,58 @@ bool kbhit_serial1(void) {
 }
 
 
-#define USBH_KEY_BUFFER_SIZE 64
+#define USBH_KEY_BUFFER_SIZE 64 // must be a power of two
 
+#if (USBH_KEY_BUFFER_SIZE & (USBH_KEY_BUFFER_SIZE - 1))
+#error USBH_KEY_BUFFER_SIZE must be a power of two
+#endif
+
+// Keys from the USB keyboard, first in first out. usbh_poll() decodes the reports in the main loop and is the
+// only writer, it moves usbhkhead. The emulator is the only reader and moves usbhktail, so neither side
+// needs to lock the other out.
+// Both count up forever, head - tail is the number of keys waiting
 uint8_t usbhkbuf[USBH_KEY_BUFFER_SIZE];
-uint8_t usbhkbufnum = 0;
+volatile uint16_t usbhkhead = 0;
+volatile uint16_t usbhktail = 0;
+volatile uint16_t usbhkdropped = 0; // keys lost because the buffer was full, read by BDOS 231 (see host.h)
 
 bool usbhkbd_write(uint8_t code) {
-    if (usbhkbufnum > USBH_KEY_BUFFER_SIZE) {
+    uint16_t head = usbhkhead;
+    if ((uint16_t)(head - usbhktail) >= USBH_KEY_BUFFER_SIZE) {
+        usbhkdropped++;
         return false;
-    } else {
-        usbhkbuf[usbhkbufnum] = code;
-        usbhkbufnum++;
-        return true;
     }
+    usbhkbuf[head & (USBH_KEY_BUFFER_SIZE - 1)] = code;
+    __dmb(); // the key is stored before it is published
+    usbhkhead = head + 1;
+    return true;
 }
 
 uint8_t usbhkbd_available(void) {
-    if (usbhkbufnum == 0) return 0;
-    else return usbhkbufnum;
+    return (uint16_t)(usbhkhead - usbhktail);
 }
 
 int usbhkbd_read(void) {
-    if (usbhkbufnum == 0) {
+    uint16_t tail = usbhktail;
+    if (usbhkhead == tail) {
         return (-1);
-    } else {
-        usbhkbufnum-- ;
-        uint8_t code = usbhkbuf[usbhkbufnum];
-        return code;
     }
+    __dmb(); // the key is read after it was published
+    uint8_t code = usbhkbuf[tail & (USBH_KEY_BUFFER_SIZE - 1)];
+    __dmb(); // and before its slot is given back
+    usbhktail = tail + 1;
+    return code;
 }
 
+#if USE_KEYBOARD
+void usbh_poll(void);   // decodes the keyboard reports received so far, see the USB section
+#endif
+
 uint8_t getch_usbh(void) {
     while(true) {
+#if USE_KEYBOARD
+        usbh_poll();
+#endif
         int r = usbhkbd_read();
         if(r != -1) {
             return r;
@@ -83,6 +104,9 @@ uint8_t getch_usbh(void) {
 }
 
 bool kbhit_usbh(void) {
+#if USE_KEYBOARD
+    usbh_poll();
+#endif
     return usbhkbd_available();
 }
 
@@ -95,7 +119,13 @@ bool kbhit_usbh(void) {
 #error This sketch requires usb stack configured as host in "Tools -> USB Stack -> Adafruit TinyUSB Host"
 #endif
 
-#define KBD_INT_TIME 100 // USB HOST processing interval us
+#define KBD_INT_TIME 100 // USB HOST processing interval us, while a key is held or reports wait
+#define KBD_IDLE_TIME 2000 // USB HOST processing interval us, while the keyboard is idle
+#define KBD_REPORTS 128 // keyboard reports waiting to be decoded, a power of two up to 128, two for each key of type-ahead
+
+#if (KBD_REPORTS & (KBD_REPORTS - 1)) || KBD_REPORTS > 128
+#error KBD_REPORTS must be a power of two up to 128
+#endif
 
 static repeating_timer_t rtimer;
 
@@ -113,7 +143,17 @@ static bool keyboard_mounted = false;
 static uint8_t keyboard_dev_addr = 0;
 static uint8_t keyboard_idx = 0;
 static uint8_t keyboard_leds = 0;
-static bool keyboard_leds_changed = false;
+static volatile bool keyboard_leds_changed = false;
+
+// Keyboard reports are only queued by the timer interrupt, the emulator decodes them when it looks at the keyboard
+static hid_keyboard_report_t kbd_report[KBD_REPORTS];
+static volatile uint8_t kbd_rhead = 0, kbd_rtail = 0;  // count up forever
+volatile uint16_t kbd_rdropped = 0;  // reports that overwrote the newest one on a full queue
+static volatile bool kbd_held = false;  // a key is down in the last report
+static volatile bool kbd_unmounted = false;  // the keyboard went away, forget its state
+
+// Time spent in the timer interrupt, read by BDOS 231 (see host.h)
+volatile uint32_t usbhIsrUs = 0, usbhIsrCalls = 0;
 
 int old_ascii = -1;
 uint32_t repeat_timeout;
@@ -127,26 +167,45 @@ void send_ascii(uint8_t code, uint32_t repeat_time=default_repeat_time) {
   usbhkbd_write(code);
 }
 
+// runs in the timer interrupt: the stack, and the LEDs which must not be sent while it runs
 void usb_host_task(void) {
   USBHost.task();
-  uint32_t now = millis();
-  uint32_t deadline = repeat_timeout - now;
-  if (old_ascii >= 0 && deadline > INT32_MAX) {
-    send_ascii(old_ascii);
-    deadline = repeat_timeout - now;
-  } else if (old_ascii < 0) {
-    deadline = UINT32_MAX;
-  }
   if (keyboard_leds_changed) {
+    keyboard_leds_changed = false;
     tuh_hid_set_report(keyboard_dev_addr, keyboard_idx, 0/*report_id*/, HID_REPORT_TYPE_OUTPUT, &keyboard_leds, sizeof(keyboard_leds));
   }
 }
 
 bool timer_callback(repeating_timer_t *rtimer) { // USB Host is executed by timer interrupt.
+  uint32_t start = time_us_32();
   usb_host_task();
+  // poll fast only while keys move, the next report is at least a USB frame away otherwise
+  rtimer->delay_us = (kbd_held || kbd_rhead != kbd_rtail) ? KBD_INT_TIME : KBD_IDLE_TIME;
+  usbhIsrUs += time_us_32() - start;
+  usbhIsrCalls++;
   return true;
 }
 
+void kbd_queue_report(const hid_keyboard_report_t &report) {
+  uint8_t head = kbd_rhead;
+  bool held = false;
+
+  for (auto keycode : report.keycode) {
+    if (keycode != 0) held = true;
+  }
+  kbd_held = held;
+  if ((uint8_t)(head - kbd_rtail) == KBD_REPORTS) {
+    // keep the latest state of the keys, so a release is never lost. The emulator may be decoding
+    // the oldest slot, never the newest one while the queue is full
+    kbd_report[(head - 1) & (KBD_REPORTS - 1)] = report;
+    kbd_rdropped++;
+    return;
+  }
+  kbd_report[head & (KBD_REPORTS - 1)] = report;
+  __dmb();
+  kbd_rhead = head + 1;
+}
+
 #endif
 
 
@@ -227,6 +286,135 @@ void msc_flush_cb(void) {
 DVItext1 display(DVI_RES_640x240p60, pico_sock_cfg);
 //DVItext1 display(DVI_RES_800x240p30, pimoroni_demo_hdmi_cfg);
 
+// Text screen, kept apart from the DVI buffer so that a scroll only moves row pointers instead of the whole screen
+// Screen row y is textLine[y], a row of textBuf. The DVI buffer is read by core 1 as it is, so the screen is copied
+// onto it, rows in order, by a timer at most once per frame and only if something changed. The timer can interrupt
+// the console in the middle of a change and copy a torn frame of chars, every change sets textDirty once it is done
+// so the next copy repairs it. Row pointers are only moved with the timer masked, a copy never follows a half
+// moved one. The cursor is not kept on the text screen, it is drawn on the DVI buffer at copy time,
+// so moving it costs nothing until the next frame
+#define TEXT_FRAME_MS 16
+
+uint16_t *textBuf;		// chars and cursor mask, laid out as on the DVI buffer
+uint16_t **textLine;		// row of textBuf shown on each line of the screen
+int textCols, textRows;
+int scrollTop, scrollBot;	// scroll region, first and last line
+volatile bool textDirty;	// changed since the last copy onto the DVI buffer
+bool textCursorOn = true;
+int shownX = -1, shownY;	// cursor as drawn on the DVI buffer, shownX -1 for none
+static repeating_timer_t dtimer;
+
+uint16_t *text_row(int y) {
+  return textLine[y];
+}
+
+// move the cursor, keeping it on the screen. It can sit just past the last column, until the next char wraps
+void text_setcursor(int x, int y) {
+  if(x < 0) x = 0;
+  if(x > textCols) x = textCols;
+  if(y < 0) y = 0;
+  if(y >= textRows) y = textRows - 1;
+  display.setCursor(x, y);
+}
+
+// column of the cell under the cursor
+int text_cursorx(void) {
+  int x = display.getCursorX();
+  return x < textCols ? x : textCols - 1;
+}
+
+// cell under the cursor
+uint16_t *text_cursor(void) {
+  return text_row(display.getCursorY()) + text_cursorx();
+}
+
+// chars from the cell under the cursor to the end of the line
+int text_tail(void) {
+  return textCols - text_cursorx();
+}
+
+void text_clear(void) {
+  memset(textBuf, 0, textCols * textRows * sizeof(uint16_t));
+  for(int i = 0; i < textRows; i++)
+    textLine[i] = textBuf + i * textCols;
+  textDirty = true;
+}
+
+void text_blank(uint16_t *cell, int n) {
+  while(n-- > 0)
+    *cell++ = ' ';
+}
+
+// scroll lines top to bot up n lines, blank lines come in at the bottom
+void text_scrollup(int top, int bot, int n) {
+  uint16_t *row;
+  uint32_t irq;
+
+  if(n > bot - top + 1) n = bot - top + 1;
+  while(n-- > 0) {
+    irq = save_and_disable_interrupts();  // the timer must not copy a row through a half moved pointer
+    row = textLine[top];
+    memmove(&textLine[top], &textLine[top + 1], (bot - top) * sizeof(uint16_t *));
+    textLine[bot] = row;
+    restore_interrupts(irq);
+    text_blank(row, textCols);
+  }
+  textDirty = true;
+}
+
+// scroll lines top to bot down n lines, blank lines come in at the top
+void text_scrolldown(int top, int bot, int n) {
+  uint16_t *row;
+  uint32_t irq;
+
+  if(n > bot - top + 1) n = bot - top + 1;
+  while(n-- > 0) {
+    irq = save_and_disable_interrupts();
+    row = textLine[bot];
+    memmove(&textLine[top + 1], &textLine[top], (bot - top) * sizeof(uint16_t *));
+    textLine[top] = row;
+    restore_interrupts(irq);
+    text_blank(row, textCols);
+  }
+  textDirty = true;
+}
+
+// cursor to the start of the next line, scrolling at the bottom of the scroll region
+void text_newline(void) {
+  int y = display.getCursorY();
+  if(y == scrollBot)
+    text_scrollup(scrollTop, scrollBot, 1);
+  else if(y < textRows - 1)
+    y++;
+  display.setCursor(0, y);
+}
+
+// copy the screen onto the DVI buffer if it changed since the last copy, and draw the cursor on it
+void text_present(void) {
+  uint16_t *buf = display.getBuffer();
+  int x = textCursorOn ? text_cursorx() : -1;
+  int y = display.getCursorY();
+
+  if(textDirty) {
+    textDirty = false;
+    for(int i = 0; i < textRows; i++)
+      memcpy(buf + i * textCols, textLine[i], textCols * sizeof(uint16_t));
+  } else if(x == shownX && y == shownY) {
+    return;
+  } else if(shownX >= 0) {
+    buf[shownY * textCols + shownX] = textLine[shownY][shownX];	// take the cursor off its old cell
+  }
+  if(x >= 0)
+    buf[y * textCols + x] = textLine[y][x] | 0x0ff00;
+  shownX = x;
+  shownY = y;
+}
+
+bool text_callback(repeating_timer_t *rtimer) {
+  text_present();
+  return true;
+}
+
 // VT100 controle is based on the following..
 //
 // https://github.com/dhansel/TerminalUSB/blob/master/firmware/src/vt100.c
@@ -240,22 +428,24 @@ DVItext1 display(DVI_RES_640x240p60, pico_sock_cfg);
 #define BOTH    3
 
 extern void putch_display(uint8_t ch);
+extern void putbuf_display(const uint8_t *buf, int len);
 extern void ClearScreen(void);
-extern void normalCh(), invCh(), write_normalCh(), write_invCh();
+extern void write_normalCh(uint8_t ch);
 
-#define VTBUF_SIZE  40
-uint8_t vtbuf[VTBUF_SIZE + 1]; // buffer for chars waiting to be decoded
-int vtcnt;		      // vtcnt of the number of chars in vtbuf
+// Escape sequence decoder states, see VT100Putc()
+#define VT_GROUND   0		// plain characters, sent straight to the display
+#define VT_ESCAPE   1		// after ESC
+#define VT_INTER    2		// after ESC and an intermediate char, the next char ends the sequence
+#define VT_CSI      3		// after ESC [, collecting the arguments up to the final char
+#define VT_IGNORE   4		// control sequence not understood, skipped up to its final char
+#define VT_ROW      5		// VT52 ESC Y, waiting for the row
+#define VT_COL      6		// VT52 ESC Y, waiting for the column
 
-int arg[8], argc;		// arguments to a command
+#define VT_ARGS     8
 
-struct s_cmdtbl {		// structure of the command table
-    char *name;			// the string
-    int mode;			// 1 = ANSI only, 2 = VT52, 3 = both
-    void (*fptr)(void);	// pointer to the function that will interpret that command
-};
-int CmdTblSize;
-extern const struct s_cmdtbl cmdtbl[];
+int vtstate;			// current state of the decoder
+char vtprivate;			// ? > = < marker at the start of a control sequence, Z for the graphics sequence
+int arg[VT_ARGS], argc;		// arguments to a command
 
 int mode;			// current mode.  can be VT100 or VT52
 
@@ -264,57 +454,16 @@ int SaveX, SaveY, SaveUL, SaveRV, SaveInvis, SaveFontNbr; // saved attributes th
 
 #define ShowCursor(x) ;
 
-void VT100Putc(uint8_t c) {
-    int cmd, i, j, partial;
-
-    if(vtcnt >= VTBUF_SIZE) return;
-    vtbuf[vtcnt++] = c;
-    partial = false;
-
-    while(vtcnt) {
-      for(cmd = 0; cmd < CmdTblSize; cmd++) {
-	if((cmdtbl[cmd].mode & mode) && *cmdtbl[cmd].name == *vtbuf) {   // check the mode then a quick check of the first char
-	  arg[0] = argc = 0;
-	  for(j = i = 1; cmdtbl[cmd].name[i] && j < vtcnt; i++, j++) {
-	    if(cmdtbl[cmd].name[i] == '^') {
-	      arg[argc++] = vtbuf[j] - 31;
-	    } else if(cmdtbl[cmd].name[i] == '@') {
-	      arg[argc] = 0;
-	      while(isdigit(vtbuf[j]))
-		arg[argc] = arg[argc] * 10 + (vtbuf[j++] - '0');
-	      j--; // correct for the overshoot, so that the next loop looks at the next char
-	      argc++;
-	    } else if(cmdtbl[cmd].name[i] != vtbuf[j])
-	      goto nextcmd;                           // compare failed, try the next command
-	  }
-	  if(cmdtbl[cmd].name[i] == 0) { // compare succeded, we have found the command
-	    vtcnt = 0;		// clear all chars in the queue
-	    cmdtbl[cmd].fptr();	// and execute the command
-	    return;
-	  } else
-	    partial = true; // partial compare so set a flag to indicate this
-	}
-      nextcmd:
-	continue;
-      } //for 
-      if(!partial) { // we have searched the table and have not even found a partial match
-	putch_display(*vtbuf);	// so send the oldest char off
-	memcpy(vtbuf, vtbuf + 1, vtcnt--); // and shift down the table
-      } else 
-	return; // have a partial match so keep the characters in the buffer
-    }		// keep looping until the buffer is empty
-}
-
 void VideoPrintString(char *p) {
   while(*p)
-    display.write(*p++);
+    putch_display(*p++);
 }
 
 // utility function to move the cursor
 void CursorPosition(int x, int y) {
   //ShowCursor(false); // turn off the cursor to prevent it from getting confused
 
-  display.setCursor(x, y);
+  text_setcursor(x, y);
   /* CursorX = (fontWidth * fontScale) * (x - 1); */
   /* if(CursorX < 0) CursorX = 0; */
   /* if(CursorX > HRes - (fontWidth * fontScale)) CursorX = HRes - (fontWidth * fontScale); */
@@ -332,20 +481,16 @@ void CursorPosition(int x, int y) {
 void cmd_CurUp(void) {
   auto x = display.getCursorX();
   auto y = display.getCursorY();
-  normalCh();
   if(argc == 0 || arg[0] == 0) arg[0] = 1;
-  display.setCursor(x, y - arg[0]-1);
-  invCh();
+  text_setcursor(x, y - arg[0]-1);
 }
 
 // cursor down one or more lines
 void cmd_CurDown(void) {
   auto x = display.getCursorX();
   auto y = display.getCursorY();
-  normalCh();
   if(argc == 0 || arg[0] == 0) arg[0] = 1;
-  display.setCursor(x, y + arg[0]-1);
-  invCh();
+  text_setcursor(x, y + arg[0]-1);
 }
 
 
@@ -354,10 +499,8 @@ void cmd_CurDown(void) {
 void cmd_CurLeft(void) {
   auto x = display.getCursorX();
   auto y = display.getCursorY();
-  normalCh();
   if(argc == 0 || arg[0] == 0) arg[0] = 1;
-  display.setCursor(x - arg[0]-1, y);
-  invCh();
+  text_setcursor(x - arg[0]-1, y);
 }
 
 
@@ -365,27 +508,21 @@ void cmd_CurLeft(void) {
 void cmd_CurRight(void) {
   auto x = display.getCursorX();
   auto y = display.getCursorY();
-  normalCh();
   if(argc == 0 || arg[0] == 0) arg[0] = 1;
-  display.setCursor(x + arg[0]-1, y);
-  invCh();
+  text_setcursor(x + arg[0]-1, y);
 }
 
 // cursor home
 void cmd_CurHome(void) {
-  normalCh();
   display.setCursor(0,0);// internal coordinate start 0..
-  invCh();
 }
 
 
 // position cursor
 void cmd_CurPosition(void) {
-  normalCh();
   if(argc < 1 || arg[0] == 0) arg[0] = 1;
   if(argc < 2 || arg[1] == 0) arg[1] = 1;
-  display.setCursor(arg[1]-1, arg[0]-1);  // note that the argument order is Y, X
-  invCh();
+  text_setcursor(arg[1]-1, arg[0]-1);  // note that the argument order is Y, X
 }
 
 // enter VT52 mode
@@ -440,13 +577,13 @@ void cmd_ClearBOS(void) {
 
 // turn the cursor off
 void cmd_CursorOff(void) {
-  //CursorOff = true;
+  textCursorOn = false;
 }
 
 
 // turn the cursor on
 void cmd_CursorOn(void) {
-  //CursorOff = false;
+  textCursorOn = true;
 }
 
 // save the current attributes
@@ -509,6 +646,9 @@ void cmd_VT100ID(void) {
 // reset the terminal
 void cmd_Reset(void) {
   mode = VT100;
+  vtstate = VT_GROUND;
+  scrollTop = 0;
+  scrollBot = textRows - 1;
   //    initFont(1);
   //ConfigBuffers(Option[O_LINES24]);
   //ShowCursor(false); // turn off the cursor to prevent it from getting confused
@@ -558,27 +698,83 @@ void cmd_ReportPosition(void) {
 
 // do a line feed
 void cmd_Lf(void) {
-  normalCh();
-  display.write('\n');
-  invCh();
+  text_newline();
 }
 
 
 // do a line feed
 void cmd_LineFeed(void) {
-  normalCh();
-  display.write('\n');
-  invCh();
+  text_newline();
 }
 
 
 // do an upwards line feed with a reverse scroll
 void cmd_ReverseLineFeed(void) {
-  //    ShowCursor(false); // turn off the cursor to prevent it from getting confused
-  //if(CharPosY > 1)
-  //CursorPosition(CharPosX, CharPosY - 1);
-  //else
-  //ScrollDown();
+  auto x = display.getCursorX();
+  auto y = display.getCursorY();
+  if(y == scrollTop)
+    text_scrolldown(scrollTop, scrollBot, 1);
+  else if(y > 0)
+    display.setCursor(x, y - 1);
+}
+
+
+// insert lines at the cursor, the lines below it move down inside the scroll region
+void cmd_InsertLine(void) {
+  auto y = display.getCursorY();
+  if(y < scrollTop || y > scrollBot) return;
+  if(argc == 0 || arg[0] == 0) arg[0] = 1;
+  text_scrolldown(y, scrollBot, arg[0]);
+  display.setCursor(0, y);
+}
+
+
+// delete lines at the cursor, the lines below it move up inside the scroll region
+void cmd_DeleteLine(void) {
+  auto y = display.getCursorY();
+  if(y < scrollTop || y > scrollBot) return;
+  if(argc == 0 || arg[0] == 0) arg[0] = 1;
+  text_scrollup(y, scrollBot, arg[0]);
+  display.setCursor(0, y);
+}
+
+
+// insert blanks at the cursor, the rest of the line moves right
+void cmd_InsertChar(void) {
+  uint16_t *cell;
+  int n;
+  cell = text_cursor();
+  n = text_tail();
+  if(argc == 0 || arg[0] == 0) arg[0] = 1;
+  if(arg[0] > n) arg[0] = n;
+  memmove(cell + arg[0], cell, (n - arg[0]) * sizeof(uint16_t));
+  text_blank(cell, arg[0]);
+  textDirty = true;
+}
+
+
+// delete chars at the cursor, the rest of the line moves left
+void cmd_DeleteChar(void) {
+  uint16_t *cell;
+  int n;
+  cell = text_cursor();
+  n = text_tail();
+  if(argc == 0 || arg[0] == 0) arg[0] = 1;
+  if(arg[0] > n) arg[0] = n;
+  memmove(cell, cell + arg[0], (n - arg[0]) * sizeof(uint16_t));
+  text_blank(cell + n - arg[0], arg[0]);
+  textDirty = true;
+}
+
+
+// set the scroll region, top and bottom lines
+void cmd_ScrollRegion(void) {
+  if(argc < 1 || arg[0] == 0) arg[0] = 1;
+  if(argc < 2 || arg[1] == 0 || arg[1] > textRows) arg[1] = textRows;
+  if(arg[0] >= arg[1]) return;
+  scrollTop = arg[0] - 1;
+  scrollBot = arg[1] - 1;
+  cmd_CurHome();
 }
 
 
@@ -626,178 +822,294 @@ void cmd_Draw(void) {
 void cmd_NULL(void) {}
 
 void ClearScreen() {
-  display.fillScreen(0);
+  text_clear();
   display.setCursor(0, 0);
-  invCh();			// set cursor
 }
 
 /***************************************************************************************************************************************
- The command table
- This is scanned from top to bottom by VT100Putc()
- Characters are matched exactly (ie, case sensitive) except for the @ character which is a wild card character representing
- zero or more decimal characters of an argument and ^ which represents a single char and the value returned is the char - 31
+ The escape sequence decoder
+ A DEC style state machine fed one char at a time by VT100Putc(). Characters outside of a sequence go straight to the display,
+ the decimal arguments of a control sequence are accumulated as they arrive and its final char selects the command to run.
+ Control chars found inside a sequence are acted upon without ending it, CAN and SUB cancel it and ESC starts a new one
  **************************************************************************************************************************************/
 
-const struct s_cmdtbl cmdtbl[]  = {
-  { "\033A",          VT52,       cmd_CurUp },
-  { "\033B",          VT52,       cmd_CurDown },
-  { "\033C",          VT52,       cmd_CurRight },
-  { "\033D",          VT52,       cmd_CurLeft },
-  { "\033H",          VT52,       cmd_CurHome },
-  { "\033I",          VT52,       cmd_ReverseLineFeed },
-  { "\033[^^",        VT52,       cmd_CurPosition },
-
-  { "\033J",          VT52,       cmd_ClearEOS },
-  { "\033K",          VT52,       cmd_ClearEOL },
-
-  { "\033>",          VT52,       cmd_SetNumLock },
-  { "\033=",          VT52,       cmd_ExitNumLock },
-
-  { "\033[Z",         VT52,       cmd_VT52ID },
-  { "\033<",          VT52,       cmd_VT100mode },
-  { "\033F",          VT52,       cmd_NULL },
-  { "\033G",          VT52,       cmd_NULL },
-    
-  { "\033[K",         VT100,      cmd_ClearEOL },
-  { "\033[J",         VT100,      cmd_ClearEOS },
-  { "\033[0K",        VT100,      cmd_ClearEOL },
-  { "\033[1K",        VT100,      cmd_ClearBOL },
-  { "\033[2K",        VT100,      cmd_ClearLine },
-  { "\033[0J",        VT100,      cmd_ClearEOS },
-  { "\033[1J",        VT100,      cmd_ClearBOS },
- 
-  { "\033[2J",        VT100,      ClearScreen },
-
-  { "\033[?25l",      VT100,      cmd_CursorOff },
-  { "\033[?25h",      VT100,      cmd_CursorOn },
-
-  { "\033[@A",        VT100,      cmd_CurUp },
-  { "\033[@B",        VT100,      cmd_CurDown },
-  { "\033[@C",        VT100,      cmd_CurRight },
-  { "\033[@D",        VT100,      cmd_CurLeft },
-  { "\033[@;@H",      VT100,      cmd_CurPosition },
-  { "\033[@;@f",      VT100,      cmd_CurPosition },
-  { "\033[H",         VT100,      cmd_CurHome },
-  { "\033[f",         VT100,      cmd_CurHome },
-  { "\0337",          VT100,      cmd_CurSave },
-  { "\0338",          VT100,      cmd_CurRestore },
-  { "\0336n",         VT100,      cmd_ReportPosition },
-    
-
-  { "\033D",          VT100,      cmd_LineFeed },
-  { "\033M",          VT100,      cmd_ReverseLineFeed },
-  { "\033E",          VT100,      cmd_Lf },
-  { "\033[?@h",       VT100,      cmd_SetMode },
-  { "\033[?@l",       VT100,      cmd_ResetMode },
-
-  { "\033[>",         VT100,      cmd_SetNumLock },
-  { "\033[=",         VT100,      cmd_ExitNumLock },
-    
-  { "\033[Z@;@;@;@;@Z",VT100,     cmd_Draw },
-  { "\033[Z@;@;@;@Z",  VT100,     cmd_Draw },
-
-  { "\033[@m" ,       VT100,      cmd_Attributes },
-  { "\033[@q" ,       VT100,      cmd_LEDs },
-  { "\033c" ,         BOTH,       cmd_Reset },
-  { "\033[c" ,        VT100,      cmd_VT100ID },
-  { "\033[0c" ,       VT100,      cmd_VT100ID },
-  { "\033[5n" ,       VT100,      cmd_VT100OK },
-  { "\033[?2l",       VT100,      cmd_VT52mode },
-};          
+// ESC followed by a final char
+void vt_escape(uint8_t c) {
+  vtstate = VT_GROUND;
+  argc = 0;
+  if(c == 'c') {
+    cmd_Reset();
+  } else if(c == '>') {
+    cmd_SetNumLock();
+  } else if(c == '=') {
+    cmd_ExitNumLock();
+  } else if(mode == VT52) {
+    switch(c) {
+    case 'A': cmd_CurUp(); break;
+    case 'B': cmd_CurDown(); break;
+    case 'C': cmd_CurRight(); break;
+    case 'D': cmd_CurLeft(); break;
+    case 'H': cmd_CurHome(); break;
+    case 'I': cmd_ReverseLineFeed(); break;
+    case 'J': cmd_ClearEOS(); break;
+    case 'K': cmd_ClearEOL(); break;
+    case 'Y': vtstate = VT_ROW; break;
+    case 'Z': cmd_VT52ID(); break;
+    case '<': cmd_VT100mode(); break;
+    }
+  } else {
+    switch(c) {
+    case '[':
+      vtstate = VT_CSI;
+      vtprivate = 0;
+      memset(arg, 0, sizeof(arg));
+      break;
+    case '7': cmd_CurSave(); break;
+    case '8': cmd_CurRestore(); break;
+    case 'D': cmd_LineFeed(); break;
+    case 'E': cmd_Lf(); break;
+    case 'M': cmd_ReverseLineFeed(); break;
+    }
+  }
+}
 
-void initVT100(void) {
-  mode = VT100;
-  vtcnt = 0;
-  CmdTblSize =  (sizeof(cmdtbl)/sizeof(struct s_cmdtbl));
-  //SaveFontNbr = -1;
+// ESC [ followed by its arguments and the final char
+void vt_csi(uint8_t c) {
+  int i, n;
+
+  vtstate = VT_GROUND;
+  if(vtprivate == '?') {
+    if(c == 'h') {
+      if(arg[0] == 25) cmd_CursorOn();
+      else cmd_SetMode();
+    } else if(c == 'l') {
+      if(arg[0] == 25) cmd_CursorOff();
+      else if(arg[0] == 2) cmd_VT52mode();
+      else cmd_ResetMode();
+    }
+    return;
+  }
+  if(vtprivate == 'Z') {	// ESC [ Z n;n;n;n Z
+    if(c == 'Z') cmd_Draw();
+    return;
+  }
+  if(vtprivate) return;
+
+  switch(c) {
+  case 'A': cmd_CurUp(); break;
+  case 'B': cmd_CurDown(); break;
+  case 'C': cmd_CurRight(); break;
+  case 'D': cmd_CurLeft(); break;
+  case 'H':
+  case 'f': cmd_CurPosition(); break;
+  case 'J':
+    if(arg[0] == 1) cmd_ClearBOS();
+    else if(arg[0] == 2) ClearScreen();
+    else cmd_ClearEOS();
+    break;
+  case 'K':
+    if(arg[0] == 1) cmd_ClearBOL();
+    else if(arg[0] == 2) cmd_ClearLine();
+    else cmd_ClearEOL();
+    break;
+  case 'm':			// each argument is an attribute
+    n = argc ? argc : 1;
+    for(i = 0; i < n; i++) {
+      arg[0] = arg[i];
+      cmd_Attributes();
+    }
+    break;
+  case 'L': cmd_InsertLine(); break;
+  case 'M': cmd_DeleteLine(); break;
+  case '@': cmd_InsertChar(); break;
+  case 'P': cmd_DeleteChar(); break;
+  case 'r': cmd_ScrollRegion(); break;
+  case 'q': cmd_LEDs(); break;
+  case 'c': if(arg[0] == 0) cmd_VT100ID(); break;
+  case 'n':
+    if(arg[0] == 5) cmd_VT100OK();
+    else if(arg[0] == 6) cmd_ReportPosition();
+    break;
+  case 'Z':			// graphics, its arguments come after the Z
+    if(argc == 0) {
+      vtstate = VT_CSI;
+      vtprivate = 'Z';
+    }
+    break;
+  }
 }
 
-#define H_TAB 8
-#define V_TAB 1
+void VT100Putc(uint8_t c) {
+  if(vtstate == VT_GROUND) {	// the usual case, a char to be displayed
+    if(c == 0x1b) vtstate = VT_ESCAPE;
+    else putch_display(c);
+    return;
+  }
+
+  if(c == 0x1b) {		// starts a new sequence, dropping the current one
+    vtstate = VT_ESCAPE;
+    return;
+  }
+  if(c == 0x18 || c == 0x1a) {	// CAN and SUB cancel the sequence
+    vtstate = VT_GROUND;
+    return;
+  }
+  if(c < 0x20 && vtstate != VT_ROW && vtstate != VT_COL) {
+    putch_display(c);		// control chars are acted upon inside a sequence
+    return;
+  }
+  if(c == 0x7f && vtstate != VT_ROW && vtstate != VT_COL) return;
+
+  switch(vtstate) {
+  case VT_ESCAPE:
+    if(c >= 0x20 && c <= 0x2f) vtstate = VT_INTER;	// ESC ( ESC # etc, charset and line size selections are ignored
+    else vt_escape(c);
+    break;
+
+  case VT_INTER:
+    if(c >= 0x30) vtstate = VT_GROUND;
+    break;
+
+  case VT_CSI:
+    if(c >= '0' && c <= '9') {
+      if(argc == 0) argc = 1;
+      if(arg[argc - 1] < 10000) arg[argc - 1] = arg[argc - 1] * 10 + (c - '0');
+    } else if(c == ';') {
+      if(argc == 0) argc = 1;
+      if(argc < VT_ARGS) argc++;
+    } else if(c >= 0x3c && c <= 0x3f) {		// private marker, only valid as the first char
+      if(argc == 0 && vtprivate == 0) vtprivate = c;
+      else vtstate = VT_IGNORE;
+    } else if(c >= 0x40 && c <= 0x7e) {
+      vt_csi(c);
+    } else {
+      vtstate = VT_IGNORE;
+    }
+    break;
+
+  case VT_IGNORE:
+    if(c >= 0x40 && c <= 0x7e) vtstate = VT_GROUND;
+    break;
+
+  case VT_ROW:
+    arg[0] = c - 31;
+    vtstate = VT_COL;
+    break;
+
+  case VT_COL:
+    arg[1] = c - 31;
+    argc = 2;
+    vtstate = VT_GROUND;
+    cmd_CurPosition();
+    break;
+  }
+}
 
-uint16_t underCursor = ' ';
+// writes len chars, runs of printable chars outside of a sequence go to the display at once
+void VT100Write(const uint8_t *buf, uint16_t len) {
+  const uint8_t *end = buf + len, *p;
 
-void normalCh() {
-  auto x = display.getCursorX();
-  auto y = display.getCursorY();
-  uint16_t *row = display.getBuffer() + y * display.width()+ x;
-  *row &= 0x0ff; 		// turn off mask bit
+  while(buf < end) {
+    if(vtstate == VT_GROUND && *buf >= 0x20 && *buf != 0x7f) {
+      for(p = buf; p < end && *p >= 0x20 && *p != 0x7f; p++);
+      putbuf_display(buf, p - buf);
+      buf = p;
+    } else {
+      VT100Putc(*buf++);
+    }
+  }
 }
 
-void invCh() {
-  auto x = display.getCursorX();
-  auto y = display.getCursorY();
-  uint16_t *row = display.getBuffer() + y * display.width()+ x;
-  *row |= 0x0ff00; 		// turn on mask bit
+void initVT100(void) {
+  mode = VT100;
+  vtstate = VT_GROUND;
+  //SaveFontNbr = -1;
 }
 
-void write_invCh(uint8_t ch) {
-  auto x = display.getCursorX();
-  auto y = display.getCursorY();
-  uint16_t *row = display.getBuffer() + y * display.width()+ x;
-  *row = 0x0ff00 + ch;
-  //display.setCursor(x+1, y);
-}  
+#define H_TAB 8
+#define V_TAB 1
 
 void write_normalCh(uint8_t ch) {
-  auto x = display.getCursorX();
-  auto y = display.getCursorY();
-  uint16_t *row = display.getBuffer() + y * display.width()+ x;
-  *row =  ch;
-  //display.setCursor(x+1, y);
+  *text_cursor() = ch;
+  textDirty = true;
 }  
 
 
 void putch_display(uint8_t ch) {
-  normalCh();  // rewrite to normal charactor at current position
   auto x = display.getCursorX();
   auto y = display.getCursorY();
   if(((ch >= 0x20) && (ch <= 0x7E)) || ((ch >= 0x80) && (ch <= 0xFF))) { //ASCII Character
-    //display.drawPixel(x, y, ch);
-    write_normalCh(ch);
+    if(x >= textCols) {	// wrap to the next line
+      text_newline();
+      x = 0;
+      y = display.getCursorY();
+    }
+    text_row(y)[x] = ch;
     display.setCursor(x+1, y); // move to next position
+    textDirty = true;
   } else {
     switch(ch) {
     case 0x08: //Backspace
       if(x > 0) {
 	display.setCursor(--x, y);
-	display.drawPixel(x, y, ' ');
+	write_normalCh(' ');
       }
       break;
       
     case 0x09: //HTab
       if(x >= 0) {
 	int n = x % H_TAB;
-	for (int i = 0; i < (H_TAB - n); ++i) {
+	for (int i = 0; i < (H_TAB - n) && x < textCols; ++i) {
 	  display.setCursor(++x, y);
-	  display.drawPixel(x, y, ' ');
+	  if(x < textCols) write_normalCh(' ');
 	}
       }
       break;
 
     case 0x0A: //LF
-      display.write('\n');
+      text_newline();
       break;
 
     case 0x0B: //VTab
-      for (int i = 0; i < V_TAB; ++i) {
-	display.write('\r');
-	display.write('\n');
-      }
+      for (int i = 0; i < V_TAB; ++i)
+	text_newline();
       y = display.getCursorY();
       for (int i = 0; i <= x; ++i) {
 	display.setCursor(i, y);
-	display.drawPixel(i, y, ' ');
+	write_normalCh(' ');
       }
       break;
 
     case 0x0D: //CR
-      display.write('\r');
+      display.setCursor(0, y);
       break;
 
     }
   }
-  invCh();  // for cursor 
+}
+
+// writes a run of printable chars, a line at a time
+void putbuf_display(const uint8_t *buf, int len) {
+  auto x = display.getCursorX();
+  auto y = display.getCursorY();
+  uint16_t *cell;
+  int n;
+
+  while(len > 0) {
+    if(x >= textCols) {	// wrap to the next line
+      text_newline();
+      x = 0;
+      y = display.getCursorY();
+    }
+    cell = text_row(y) + x;
+    n = textCols - x < len ? textCols - x : len;
+    x += n;
+    len -= n;
+    while(n--)
+      *cell++ = *buf++;
+  }
+  display.setCursor(x, y);
+  textDirty = true;
 }
 
 #endif // USE_DISPLAY
@@ -809,12 +1121,26 @@ bool port_init_early() {
   if (!display.begin()) {
     return false;
   }
+  textCols = display.width();
+  textRows = display.height();
+  textBuf = (uint16_t *)malloc(textCols * textRows * sizeof(uint16_t));
+  textLine = (uint16_t **)malloc(textRows * sizeof(uint16_t *));
+  if (!textBuf || !textLine) {
+    return false;
+  }
+  text_clear();
+  scrollTop = 0;
+  scrollBot = textRows - 1;
   _putch_hook = VT100Putc;;
+  _putbuf_hook = VT100Write;
   initVT100();  // initialize state
+  // the screen is copied onto the DVI buffer by timer interrupt.
+  add_repeating_timer_ms( TEXT_FRAME_MS/*ms*/, text_callback, NULL, &dtimer );
   
 #endif
 
 #if USE_KEYBOARD
+  keymap_build();
   USBHost.begin(0);
   // USB Host is executed by timer interrupt.
   add_repeating_timer_us( KBD_INT_TIME/*us*/, timer_callback, NULL, &rtimer );
@@ -878,7 +1204,8 @@ void process_boot_kbd_report(uint8_t dev_addr, uint8_t idx, const hid_keyboard_r
   bool num = old_report.reserved & 1;
   bool caps = old_report.reserved & 2;
 
-  uint8_t code = 0;
+  const keymap_layout &layout = keymap_layouts[keymap_layout_in_use];
+  uint8_t state, code;
 
   if (report.keycode[0] == 1 && report.keycode[1] == 1) {
     // keyboard says it has exceeded max kro
@@ -895,36 +1222,16 @@ void process_boot_kbd_report(uint8_t dev_addr, uint8_t idx, const hid_keyboard_r
     /* key is newly pressed */
     if (keycode == HID_KEY_NUM_LOCK) {
       num = !num;
-#ifdef USE_JP_KEYBOARD
-    } else if ((keycode == HID_KEY_CAPS_LOCK) && shift) {
-#else
-    } else if (keycode == HID_KEY_CAPS_LOCK) {
-#endif
+    } else if ((keycode == HID_KEY_CAPS_LOCK) && (shift || !layout.caps_shift)) {
       caps = !caps;
+    } else if ((keycode == HID_KEY_F12) && ctrl && alt) {
+      keymap_layout_in_use = (keymap_layout_in_use + 1) % KEYMAP_LAYOUTS;
     } else {
-      for (const auto &mapper : keycode_to_ascii) {
-        if (!(keycode >= mapper.first && keycode <= mapper.last))
-          continue;
-        if (mapper.flags & FLAG_SHIFT && !shift)
-          continue;
-        if (mapper.flags & FLAG_NUMLOCK && !num)
-          continue;
-        if (mapper.flags & FLAG_CTRL && !ctrl)
-          continue;
-        if (mapper.flags & FLAG_LUT) {
-          code = lut[mapper.code][keycode - mapper.first];
-        } else {
-          code = keycode - mapper.first + mapper.code;
-        }
-        if (mapper.flags & FLAG_ALPHABETIC) {
-          if (shift ^ caps) {
-            code ^= ('a' ^ 'A');
-          }
-        }
-        if (ctrl) code &= 0x1f;
+      state = (shift ? KEYSTATE_SHIFT : 0) | (caps ? KEYSTATE_CAPS : 0) | (ctrl ? KEYSTATE_CTRL : 0) | (num ? KEYSTATE_NUM : 0);
+      code = keymap_table[keymap_layout_in_use][state][keycode];
+      if (code != KEY_NONE) {
         if (alt) code ^= 0x80;
         send_ascii(code, initial_repeat_time); // send code
-        break;
       }
     }
   }
@@ -936,13 +1243,12 @@ void process_boot_kbd_report(uint8_t dev_addr, uint8_t idx, const hid_keyboard_r
     // no worky
     //auto r = tuh_hid_set_report(dev_addr, idx/*idx*/, 0/*report_id*/, HID_REPORT_TYPE_OUTPUT/*report_type*/, &leds, sizeof(leds));
     //tuh_hid_set_report(dev_addr, idx/*idx*/, 0/*report_id*/, HID_REPORT_TYPE_OUTPUT/*report_type*/, &leds, sizeof(leds));
-  } else {
-    keyboard_leds_changed = false;
   }
   old_report = report;
   old_report.reserved = keyboard_leds;
 }
 
+
 /*
 //--------------------------------------------------------------------+
 // Generic Report
@@ -1065,8 +1371,8 @@ void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t idx)
     keyboard_mounted = false;
     keyboard_dev_addr = 0;
     keyboard_idx = 0;
-    keyboard_leds = 0;
-    old_report = {0};
+    kbd_held = false;
+    kbd_unmounted = true;
   }
 }
 
@@ -1079,7 +1385,7 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t idx, uint8_t const* re
   {
     case HID_ITF_PROTOCOL_KEYBOARD:
       if (keyboard_mounted == true) {
-        process_boot_kbd_report(dev_addr, idx, *(hid_keyboard_report_t const*) report );
+        kbd_queue_report(*(hid_keyboard_report_t const*) report);
       }
       break;
 
@@ -1101,3 +1407,28 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t idx, uint8_t const* re
 #if defined(__cplusplus)
 }
 #endif
+
+#if USE_KEYBOARD
+
+// decodes the queued reports and repeats the held key, outside of the interrupt
+void usbh_poll(void) {
+  uint8_t tail = kbd_rtail;
+
+  while (tail != kbd_rhead) {
+    __dmb();
+    hid_keyboard_report_t report = kbd_report[tail & (KBD_REPORTS - 1)];
+    kbd_rtail = ++tail;
+    process_boot_kbd_report(keyboard_dev_addr, keyboard_idx, report);
+  }
+  if (kbd_unmounted) {
+    kbd_unmounted = false;
+    keyboard_leds = 0;
+    old_report = {0};
+    old_ascii = -1;
+  }
+  if (old_ascii >= 0 && (int32_t)(repeat_timeout - millis()) < 0) {
+    send_ascii(old_ascii);
+  }
+}
+
+#endif
@@ -2,6 +2,48 @@
 #define HOST_H
 
 uint8 hostbdos(uint16 dmaaddr) {
+#ifdef WRITEBEHIND
+	// Copies the write behind statistics to dmaaddr, as 16 bit words:
+	// queue depth histogram (8), commit latency histogram (8), commits, failed writes
+	uint8 i;
+
+	for (i = 0; i < WB_BUCKETS; ++i) {
+		_RamWrite16(dmaaddr + i * 2, wbDepthHist[i]);
+		_RamWrite16(dmaaddr + 16 + i * 2, wbLatencyHist[i]);
+	}
+	_RamWrite16(dmaaddr + 32, wbCommits);
+	_RamWrite16(dmaaddr + 34, wbErrors);
+#endif
+#ifdef SERIAL_TXRING
+	// Then the serial transmit ring statistics, at dmaaddr + 36:
+	// bytes dropped (32 bit, low word first), ring high watermark
+	_RamWrite16(dmaaddr + 36, txDropped & 0xffff);
+	_RamWrite16(dmaaddr + 38, txDropped >> 16);
+	_RamWrite16(dmaaddr + 40, txHighWater);
+#endif
+#if USE_KEYBOARD
+	// Then the USB host timer interrupt, at dmaaddr + 42: time spent in it in microseconds and
+	// times it ran (32 bit each, low word first), keyboard reports merged into a full queue
+	_RamWrite16(dmaaddr + 42, usbhIsrUs & 0xffff);
+	_RamWrite16(dmaaddr + 44, usbhIsrUs >> 16);
+	_RamWrite16(dmaaddr + 46, usbhIsrCalls & 0xffff);
+	_RamWrite16(dmaaddr + 48, usbhIsrCalls >> 16);
+	_RamWrite16(dmaaddr + 50, kbd_rdropped);
+#endif
+#ifdef SERIAL_RXRING
+	// Then the serial receive ring statistics, at dmaaddr + 52: bytes lost in the UART and
+	// to a full ring (32 bit each, low word first), bytes with errors, ring high watermark
+	_RamWrite16(dmaaddr + 52, rxOverruns & 0xffff);
+	_RamWrite16(dmaaddr + 54, rxOverruns >> 16);
+	_RamWrite16(dmaaddr + 56, rxDropped & 0xffff);
+	_RamWrite16(dmaaddr + 58, rxDropped >> 16);
+	_RamWrite16(dmaaddr + 60, rxErrors);
+	_RamWrite16(dmaaddr + 62, rxHighWater);
+#endif
+#if USE_KEYBOARD
+	// Then the keys lost to a full USB keyboard buffer, at dmaaddr + 64
+	_RamWrite16(dmaaddr + 64, usbhkdropped);
+#endif
 	return(0x00);
 }
 
@@ -0,0 +1,291 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+/* RAM drive, keeps the files of drive RAMDISK in memory instead of on the card */
+/*===============================================================================*/
+// Files are stored on blocks of RAMDISK_BLOCK bytes, chained like on a FAT volume
+// Host names on this drive follow the usual "M/U/NAME.EXT" form
+
+#define RAMDISK_BLOCK 1024						// Bytes on each block
+#define RAMDISK_BLOCKS (RAMDISK_SIZE / RAMDISK_BLOCK)
+#define RAMDISK_FILES 64						// Maximum number of files
+#define RD_FREE 0xffff							// Block is not in use
+#define RD_LAST 0xfffe							// Block is the last of its file
+
+typedef struct {
+	uint8 user;			// User number, 0xff if the entry is free
+	uint8 name[11];		// File name in FCB format
+	uint32 size;		// File size in bytes
+	uint16 first;		// First block, RD_LAST if the file is empty
+} RD_FILE;
+
+static uint8 rdData[RAMDISK_BLOCKS][RAMDISK_BLOCK];
+static uint16 rdNext[RAMDISK_BLOCKS];
+static RD_FILE rdFile[RAMDISK_FILES];
+static bool rdReady = false;
+static bool rdFind = false;				// Directory search is on the RAM drive
+static uint8 rdFindPos;					// Next entry to be checked on a search
+static uint8 rdFindUser;				// User being searched
+
+// Clears the drive
+void _rd_init(void) {
+	uint16 i;
+
+	for (i = 0; i < RAMDISK_BLOCKS; ++i)
+		rdNext[i] = RD_FREE;
+	for (i = 0; i < RAMDISK_FILES; ++i)
+		rdFile[i].user = 0xff;
+	rdReady = true;
+}
+
+// Tells whether a host path is on the RAM drive
+bool _rd_isram(uint8* filename) {
+	return(filename[0] == RAMDISK);
+}
+
+// Finds the entry of a "M/U/NAME.EXT" path, NULL if it does not exist
+RD_FILE* _rd_find(uint8* filename) {
+	uint8 name[11];
+	uint8 user;
+	uint8 i;
+
+	if (!rdReady)
+		_rd_init();
+	if (filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR)
+		return(NULL);
+	if (!_sys_dirfcbname((char*)&filename[4], name))
+		return(NULL);
+	user = filename[2] <= '9' ? filename[2] - '0' : toupper(filename[2]) - 'A' + 10;
+	for (i = 0; i < RAMDISK_FILES; ++i) {
+		if (rdFile[i].user == user && !memcmp(rdFile[i].name, name, 11))
+			return(&rdFile[i]);
+	}
+	return(NULL);
+}
+
+// Allocates a free block and links it after last, RD_FREE if the drive is full
+uint16 _rd_alloc(uint16 last, RD_FILE* f) {
+	uint16 i;
+
+	for (i = 0; i < RAMDISK_BLOCKS; ++i) {
+		if (rdNext[i] == RD_FREE) {
+			rdNext[i] = RD_LAST;
+			if (last == RD_LAST)
+				f->first = i;
+			else
+				rdNext[last] = i;
+			return(i);
+		}
+	}
+	return(RD_FREE);
+}
+
+// Frees the blocks after the first len bytes of a file
+void _rd_shrink(RD_FILE* f, uint32 len) {
+	uint16 b = f->first;
+	uint16 last = RD_LAST;
+	uint16 n;
+	uint32 pos = 0;
+
+	while (b != RD_LAST && pos < len) {
+		last = b;
+		b = rdNext[b];
+		pos += RAMDISK_BLOCK;
+	}
+	if (last == RD_LAST) {
+		f->first = RD_LAST;
+	} else {
+		rdNext[last] = RD_LAST;
+		if (len % RAMDISK_BLOCK)	// Clears what is left of the last block, so it reads back as zeros if the file grows
+			memset(&rdData[last][len % RAMDISK_BLOCK], 0, RAMDISK_BLOCK - len % RAMDISK_BLOCK);
+	}
+	while (b != RD_LAST) {
+		n = rdNext[b];
+		rdNext[b] = RD_FREE;
+		b = n;
+	}
+	if (f->size > len)
+		f->size = len;
+}
+
+// Copies up to len bytes between a file at fpos and buf, growing the file when writing
+// Returns the number of bytes copied
+uint32 _rd_copy(RD_FILE* f, uint32 fpos, uint8* buf, uint32 len, bool write) {
+	uint16 b = f->first;
+	uint16 last = RD_LAST;
+	uint32 pos = 0;
+	uint32 done = 0;
+	uint32 off, n;
+
+	if (!write) {
+		if (fpos >= f->size)
+			return(0);
+		if (len > f->size - fpos)
+			len = f->size - fpos;
+	}
+	while (done < len) {
+		if (b == RD_LAST) {
+			if (!write || (b = _rd_alloc(last, f)) == RD_FREE)
+				break;
+			memset(rdData[b], 0, RAMDISK_BLOCK);	// Gaps read back as zeros, as on the card
+		}
+		if (fpos + done < pos + RAMDISK_BLOCK) {
+			off = fpos + done - pos;
+			n = RAMDISK_BLOCK - off;
+			if (n > len - done)
+				n = len - done;
+			if (write)
+				memcpy(&rdData[b][off], &buf[done], n);
+			else
+				memcpy(&buf[done], &rdData[b][off], n);
+			done += n;
+		}
+		last = b;
+		b = rdNext[b];
+		pos += RAMDISK_BLOCK;
+	}
+	if (write && fpos + done > f->size)
+		f->size = fpos + done;
+	return(done);
+}
+
+int _rd_makefile(uint8* filename) {
+	uint8 i;
+
+	if (_rd_find(filename))
+		return(1);
+	for (i = 0; i < RAMDISK_FILES; ++i) {
+		if (rdFile[i].user == 0xff) {
+			if (!_sys_dirfcbname((char*)&filename[4], rdFile[i].name))
+				return(0);
+			rdFile[i].user = filename[2] <= '9' ? filename[2] - '0' : toupper(filename[2]) - 'A' + 10;
+			rdFile[i].size = 0;
+			rdFile[i].first = RD_LAST;
+			return(1);
+		}
+	}
+	return(0);
+}
+
+int _rd_deletefile(uint8* filename) {
+	RD_FILE* f = _rd_find(filename);
+
+	if (!f)
+		return(0);
+	_rd_shrink(f, 0);
+	f->user = 0xff;
+	return(1);
+}
+
+int _rd_renamefile(uint8* filename, uint8* newname) {
+	RD_FILE* f = _rd_find(filename);
+
+	if (!f || _rd_find(newname))
+		return(0);
+	if (!_sys_dirfcbname((char*)&newname[4], f->name))
+		return(0);
+	return(1);
+}
+
+bool _rd_truncate(uint8* filename, uint8 rc) {
+	RD_FILE* f = _rd_find(filename);
+
+	if (!f)
+		return(false);
+	_rd_shrink(f, rc * BlkSZ);
+	return(true);
+}
+
+// Reads up to *recs records into the DMA buffer, same results as _sys_readrecs
+uint8 _rd_read(RD_FILE* f, long fpos, uint8* recs) {
+	uint16 count = *recs;
+	uint32 bytesread;
+	uint16 i;
+
+	bytesread = _rd_copy(f, fpos, _RamSysAddr(dmaAddr), count * BlkSZ, false);
+	*recs = (bytesread + BlkSZ - 1) / BlkSZ;
+	for (i = bytesread; i < *recs * BlkSZ; ++i)
+		_RamWrite(dmaAddr + i, 0x1a);
+	return(*recs == count ? 0x00 : 0x01);
+}
+
+uint8 _rd_readseq(uint8* filename, long fpos, uint8* recs) {
+	RD_FILE* f = _rd_find(filename);
+
+	if (!f) {
+		*recs = 0;
+		return(0x10);
+	}
+	return(_rd_read(f, fpos, recs));
+}
+
+uint8 _rd_readrand(uint8* filename, long fpos, uint8* recs) {
+	RD_FILE* f = _rd_find(filename);
+	uint32 extSize;
+
+	if (!f) {
+		*recs = 0;
+		return(0x10);
+	}
+	if (fpos <= f->size)
+		return(_rd_read(f, fpos, recs));
+	*recs = 0;
+	if (fpos >= 65536L * BlkSZ)
+		return(0x06);	// seek past 8MB (largest file size in CP/M)
+	// round file size up to next full logical extent
+	extSize = ExtSZ * ((f->size / ExtSZ) + ((f->size % ExtSZ) ? 1 : 0));
+	return(fpos < extSize ? 0x01 : 0x04);
+}
+
+// Writes *recs records from the DMA buffer, same results as _sys_writerecs
+uint8 _rd_write(uint8* filename, long fpos, uint8* recs) {
+	RD_FILE* f = _rd_find(filename);
+	uint16 count = *recs;
+	uint32 written;
+
+	if (!f) {
+		*recs = 0;
+		return(0x10);
+	}
+	written = _rd_copy(f, fpos, _RamSysAddr(dmaAddr), count * BlkSZ, true);
+	*recs = written / BlkSZ;
+	if (*recs == count)
+		return(0x00);
+	return(*recs ? 0x02 : 0xff);
+}
+
+uint16 _rd_loadfile(uint8* filename, long fpos, uint16 address, uint16 limit) {
+	RD_FILE* f = _rd_find(filename);
+	uint32 bytesread;
+	uint16 recs;
+	uint16 pad;
+
+	if (!f || address >= limit)
+		return(0);
+	bytesread = _rd_copy(f, fpos, _RamSysAddr(address), limit - address, false);
+	recs = (bytesread + BlkSZ - 1) / BlkSZ;
+	for (pad = bytesread; pad < recs * BlkSZ; ++pad)
+		_RamWrite(address + pad, 0x1a);
+	return(recs);
+}
+
+// Returns the next file from entry *pos on that matches user (0xff for any) and pattern, NULL if there is none
+RD_FILE* _rd_findnext(uint8* pos, uint8 user, uint8* pattern) {
+	uint8 name[12];
+	RD_FILE* f;
+
+	if (!rdReady)
+		_rd_init();
+	while (*pos < RAMDISK_FILES) {
+		f = &rdFile[(*pos)++];
+		if (f->user == 0xff || (user != 0xff && f->user != user))
+			continue;
+		memcpy(name, f->name, 11);
+		name[11] = 0;
+		if (match(name, pattern))
+			return(f);
+	}
+	return(NULL);
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef ROMDISK_H
+#define ROMDISK_H
+
+/* ROM drive, a read only drive served from a packed image */
+/*===============================================================================*/
+// The image is built on the host by tools/romdisk_pack.py, from a folder laid out like a RunCPM drive
+// It is either linked into flash (ROMDISK_FLASH, from the generated romdisk_image.h) or read from ROMDISK_FILE
+// on the card root, which is kept open
+//
+// Image layout, all numbers little endian:
+//   Header  16 bytes   "RCPMROM1", files (2), blocks (2), block size (2), reserved (2)
+//   Files   20 bytes   user (1), FCB name (11), size (4), first block (2), reserved (2)
+//   Blocks  4 bytes    offset of each block from the image start, plus one for the end of the last block
+//   Data               each block holds up to block size bytes of a file, LZSS compressed
+//                      a block is stored as is when compressing it would not make it smaller
+
+#define RO_HEADER 16
+#define RO_ENTRY 20
+#define RO_MAXBLOCK 1024						// Largest block size supported
+
+typedef struct {
+	uint8 user;			// User number
+	uint8 name[11];		// File name in FCB format
+	uint32 size;		// File size in bytes
+	uint16 first;		// First block of the file
+} RO_FILE;
+
+#ifdef ROMDISK_FLASH
+#include "romdisk_image.h"						// Defines romdiskImage[]
+#else
+static File32 roImage;
+#endif
+static uint8 roState = 0;						// 0 not opened yet, 1 ready, 2 no valid image
+static uint16 roFiles;
+static uint16 roBlocks;
+static uint16 roBlockSize;
+static RO_FILE roFile;							// Entry last found
+static uint8 roPacked[RO_MAXBLOCK];			// Block being unpacked
+static uint8 roCache[RO_MAXBLOCK];				// Last block unpacked
+static int32 roCached = -1;						// Number of the block in roCache, -1 if none
+static bool roFind = false;						// Directory search is on the ROM drive
+static uint16 roFindPos;						// Next entry to be checked on a search
+static uint8 roFindUser;						// User being searched
+
+// Copies len bytes from offset on the image
+bool _ro_fetch(uint32 offset, uint8* buf, uint16 len) {
+#ifdef ROMDISK_FLASH
+	if (offset + len > sizeof(romdiskImage))
+		return(false);
+	memcpy(buf, &romdiskImage[offset], len);
+	return(true);
+#else
+	return(roImage.seek(offset) && roImage.read(buf, len) == len);
+#endif
+}
+
+uint16 _ro_get16(uint8* p) {
+	return(p[0] | (p[1] << 8));
+}
+
+uint32 _ro_get32(uint8* p) {
+	return(p[0] | (p[1] << 8) | ((uint32)p[2] << 16) | ((uint32)p[3] << 24));
+}
+
+// Opens the image and checks its header, returns false if there is no valid image
+bool _ro_ready(void) {
+	uint8 header[RO_HEADER];
+
+	if (!roState) {
+		roState = 2;
+#ifndef ROMDISK_FLASH
+		if (!(roImage = SD.open(ROMDISK_FILE, O_READ)))
+			return(false);
+#endif
+		if (_ro_fetch(0, header, RO_HEADER) && !memcmp(header, "RCPMROM1", 8)) {
+			roFiles = _ro_get16(&header[8]);
+			roBlocks = _ro_get16(&header[10]);
+			roBlockSize = _ro_get16(&header[12]);
+			if (roBlockSize && roBlockSize <= RO_MAXBLOCK)
+				roState = 1;
+		}
+	}
+	return(roState == 1);
+}
+
+// Tells whether a host path is on the ROM drive
+bool _ro_isrom(uint8* filename) {
+	return(filename[0] == ROMDISK);
+}
+
+// Reads entry i of the file list into roFile
+bool _ro_entry(uint16 i) {
+	uint8 e[RO_ENTRY];
+
+	if (!_ro_fetch(RO_HEADER + (uint32)i * RO_ENTRY, e, RO_ENTRY))
+		return(false);
+	roFile.user = e[0];
+	memcpy(roFile.name, &e[1], 11);
+	roFile.size = _ro_get32(&e[12]);
+	roFile.first = _ro_get16(&e[16]);
+	return(true);
+}
+
+// Finds the entry of a "P/U/NAME.EXT" path and leaves it on roFile, NULL if it does not exist
+RO_FILE* _ro_find(uint8* filename) {
+	uint8 name[11];
+	uint8 user;
+	uint16 i;
+
+	if (!_ro_ready())
+		return(NULL);
+	if (filename[1] != FOLDERCHAR || filename[3] != FOLDERCHAR)
+		return(NULL);
+	if (!_sys_dirfcbname((char*)&filename[4], name))
+		return(NULL);
+	user = filename[2] <= '9' ? filename[2] - '0' : toupper(filename[2]) - 'A' + 10;
+	for (i = 0; i < roFiles; ++i) {
+		if (!_ro_entry(i))
+			break;
+		if (roFile.user == user && !memcmp(roFile.name, name, 11))
+			return(&roFile);
+	}
+	return(NULL);
+}
+
+// Unpacks block b onto roCache, raw is the number of bytes it holds once unpacked
+bool _ro_unpack(uint16 b, uint16 raw) {
+	uint8* src = roPacked;
+	uint8 offs[8];
+	uint32 start, end;
+	uint16 len, i, o, n, dist;
+	uint8 flags = 0, bit = 0;
+
+	if (roCached == b)
+		return(true);
+	roCached = -1;
+	if (b >= roBlocks || !_ro_fetch(RO_HEADER + (uint32)roFiles * RO_ENTRY + (uint32)b * 4, offs, 8))
+		return(false);
+	start = _ro_get32(&offs[0]);
+	end = _ro_get32(&offs[4]);
+	if (end < start || end - start > RO_MAXBLOCK)
+		return(false);
+	len = end - start;
+	if (!_ro_fetch(start, src, len))
+		return(false);
+	if (len == raw) {	// Stored as is
+		memcpy(roCache, src, len);
+	} else {			// LZSS: a flag byte for every 8 items, 1 = literal, 0 = 12 bit distance + 4 bit length (3 to 18)
+		i = 0;
+		o = 0;
+		while (o < raw && i < len) {
+			if (!bit) {
+				flags = src[i++];
+				bit = 8;
+			}
+			--bit;
+			if (flags & 1) {
+				if (i >= len)	// The block ended after a flag byte
+					return(false);
+				roCache[o++] = src[i++];
+			} else {
+				if (i + 1 >= len)
+					return(false);
+				dist = (src[i] | ((src[i + 1] & 0x0f) << 8)) + 1;
+				n = (src[i + 1] >> 4) + 3;
+				i += 2;
+				if (dist > o)
+					return(false);
+				while (n-- && o < raw) {
+					roCache[o] = roCache[o - dist];
+					++o;
+				}
+			}
+			flags >>= 1;
+		}
+		if (o != raw)
+			return(false);
+	}
+	roCached = b;
+	return(true);
+}
+
+// Copies up to len bytes from a file at fpos onto buf, returns the number of bytes copied
+uint32 _ro_copy(RO_FILE* f, uint32 fpos, uint8* buf, uint32 len) {
+	uint32 done = 0;
+	uint32 blk, off, raw, n;
+
+	if (fpos >= f->size)
+		return(0);
+	if (len > f->size - fpos)
+		len = f->size - fpos;
+	while (done < len) {
+		blk = (fpos + done) / roBlockSize;
+		off = (fpos + done) % roBlockSize;
+		raw = f->size - blk * roBlockSize;
+		if (raw > roBlockSize)
+			raw = roBlockSize;
+		if (!_ro_unpack(f->first + blk, raw))
+			break;
+		n = raw - off;
+		if (n > len - done)
+			n = len - done;
+		memcpy(&buf[done], &roCache[off], n);
+		done += n;
+	}
+	return(done);
+}
+
+// Reads up to *recs records into the DMA buffer, same results as _sys_readrecs
+uint8 _ro_read(RO_FILE* f, long fpos, uint8* recs) {
+	uint16 count = *recs;
+	uint32 bytesread;
+	uint16 i;
+
+	bytesread = _ro_copy(f, fpos, _RamSysAddr(dmaAddr), count * BlkSZ);
+	*recs = (bytesread + BlkSZ - 1) / BlkSZ;
+	for (i = bytesread; i < *recs * BlkSZ; ++i)
+		_RamWrite(dmaAddr + i, 0x1a);
+	return(*recs == count ? 0x00 : 0x01);
+}
+
+uint8 _ro_readseq(uint8* filename, long fpos, uint8* recs) {
+	RO_FILE* f = _ro_find(filename);
+
+	if (!f) {
+		*recs = 0;
+		return(0x10);
+	}
+	return(_ro_read(f, fpos, recs));
+}
+
+uint8 _ro_readrand(uint8* filename, long fpos, uint8* recs) {
+	RO_FILE* f = _ro_find(filename);
+	uint32 extSize;
+
+	if (!f) {
+		*recs = 0;
+		return(0x10);
+	}
+	if (fpos <= f->size)
+		return(_ro_read(f, fpos, recs));
+	*recs = 0;
+	if (fpos >= 65536L * BlkSZ)
+		return(0x06);	// seek past 8MB (largest file size in CP/M)
+	// round file size up to next full logical extent
+	extSize = ExtSZ * ((f->size / ExtSZ) + ((f->size % ExtSZ) ? 1 : 0));
+	return(fpos < extSize ? 0x01 : 0x04);
+}
+
+uint16 _ro_loadfile(uint8* filename, long fpos, uint16 address, uint16 limit) {
+	RO_FILE* f = _ro_find(filename);
+	uint32 bytesread;
+	uint16 recs;
+	uint16 pad;
+
+	if (!f || address >= limit)
+		return(0);
+	bytesread = _ro_copy(f, fpos, _RamSysAddr(address), limit - address);
+	recs = (bytesread + BlkSZ - 1) / BlkSZ;
+	for (pad = bytesread; pad < recs * BlkSZ; ++pad)
+		_RamWrite(address + pad, 0x1a);
+	return(recs);
+}
+
+// Returns the next file from entry *pos on that matches user (0xff for any) and pattern, NULL if there is none
+RO_FILE* _ro_findnext(uint16* pos, uint8 user, uint8* pattern) {
+	uint8 name[12];
+
+	if (!_ro_ready())
+		return(NULL);
+	while (*pos < roFiles) {
+		if (!_ro_entry((*pos)++))
+			break;
+		if (user != 0xff && roFile.user != user)
+			continue;
+		memcpy(name, roFile.name, 11);
+		name[11] = 0;
+		if (match(name, pattern))
+			return(&roFile);
+	}
+	return(NULL);
+}
+
+#endif
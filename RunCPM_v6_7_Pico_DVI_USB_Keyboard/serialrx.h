@@ -0,0 +1,139 @@
+#ifndef SERIALRX_H
+#define SERIALRX_H
+
+/* Serial receive ring, console input from Serial1 is moved onto a ring by the UART interrupt */
+/*===============================================================================*/
+// The core's SerialUART drops bytes once its small FIFO is full, so its interrupt handler is replaced after
+// Serial1.begin() by one that empties the UART FIFO onto this ring. When the ring is half full the sender is
+// asked to stop (see SERIAL_FLOW), and to go on once the emulator has read it down to a quarter
+// UART0's own CTS/RTS pins are taken by the SD card and the DVI output, so RTS is driven on a plain GPIO
+
+#include <hardware/uart.h>
+#include <hardware/irq.h>
+#include <hardware/gpio.h>
+#include <hardware/sync.h>
+
+#if (SERIAL_RXRING & (SERIAL_RXRING - 1)) || SERIAL_RXRING < 1024 || SERIAL_RXRING > 32768
+#error SERIAL_RXRING must be a power of two from 1024 to 32768
+#endif
+
+#define RXRING_UART uart0		// UART behind Serial1
+#define RXRING_IRQ UART0_IRQ
+#define RXRING_RTS 22			// GP22 is RTS, active low, to the CTS input of the other side
+#define RXRING_STOP (SERIAL_RXRING / 2)		// Bytes waiting when the sender is stopped, the other half takes what
+											// it still sends (a USB serial adapter may have a few hundred queued)
+#define RXRING_GO (SERIAL_RXRING / 4)		// Bytes waiting when it may go on
+
+#define RXFLOW_NONE 0			// Values of SERIAL_FLOW
+#define RXFLOW_XONXOFF 1
+#define RXFLOW_RTS 2
+
+#define XON 0x11
+#define XOFF 0x13
+
+static uint8 rxRing[SERIAL_RXRING];
+static volatile uint16 rxHead = 0;	// Next byte received, moved by the interrupt
+static volatile uint16 rxTail = 0;	// Next byte read, moved by the emulator. Both count up forever
+static volatile bool rxStopped = false;	// The sender was told to stop
+
+// Statistics, read by BDOS 231 (see host.h)
+static uint32 rxOverruns = 0;		// Bytes lost in the UART, its FIFO was full before the interrupt ran
+static uint32 rxDropped = 0;		// Bytes lost to a full ring, the sender did not stop in time
+static uint16 rxErrors = 0;			// Bytes thrown away for a framing or parity error, or a break
+static uint16 rxHighWater = 0;		// Most bytes ever waiting on the ring
+
+// Tells the sender to stop, or to go on. XON/XOFF waits for room in the FIFO, the next call tries again
+static void _rx_flow(bool stop) {
+#if SERIAL_FLOW == RXFLOW_RTS
+	gpio_put(RXRING_RTS, stop);
+	rxStopped = stop;
+#elif SERIAL_FLOW == RXFLOW_XONXOFF
+	if (uart_is_writable(RXRING_UART)) {
+		uart_get_hw(RXRING_UART)->dr = stop ? XOFF : XON;
+		rxStopped = stop;
+	}
+#endif
+}
+
+void __not_in_flash_func(_rx_irq)(void) {
+	uint16 head = rxHead;
+	uint32 dr;
+
+	while (uart_is_readable(RXRING_UART)) {
+		dr = uart_get_hw(RXRING_UART)->dr;
+		if (dr & UART_UARTDR_OE_BITS)
+			++rxOverruns;
+		if (dr & (UART_UARTDR_BE_BITS | UART_UARTDR_PE_BITS | UART_UARTDR_FE_BITS)) {
+			++rxErrors;
+			continue;
+		}
+		if ((uint16)(head - rxTail) == SERIAL_RXRING) {
+			++rxDropped;
+			continue;
+		}
+		rxRing[head & (SERIAL_RXRING - 1)] = dr;
+		++head;
+	}
+	rxHead = head;
+	if ((uint16)(head - rxTail) > rxHighWater)
+		rxHighWater = head - rxTail;
+	if (!rxStopped && (uint16)(head - rxTail) >= RXRING_STOP)
+		_rx_flow(true);
+#ifdef SERIAL_TXRING
+	_tx_irq();			// The transmit ring is fed from this interrupt too
+#endif
+}
+
+// Lets the sender go on once the ring has been read down
+static void _rx_go(void) {
+	uint32 irq;
+
+	if (rxStopped && (uint16)(rxHead - rxTail) <= RXRING_GO) {
+		irq = save_and_disable_interrupts();
+		_rx_flow(false);
+		restore_interrupts(irq);
+	}
+}
+
+int _rx_available(void) {
+	_rx_go();
+	return((uint16)(rxHead - rxTail));
+}
+
+// Next byte, waits for one
+uint8 _rx_read(void) {
+	uint16 tail = rxTail;
+	uint8 ch;
+
+	while (tail == rxHead)
+		;
+	ch = rxRing[tail & (SERIAL_RXRING - 1)];
+	rxTail = tail + 1;
+	_rx_go();
+	return(ch);
+}
+
+// Takes the UART interrupt over from Serial1, called after Serial1.begin()
+void _rx_begin(void) {
+	irq_handler_t core;
+
+#if SERIAL_FLOW == RXFLOW_RTS
+	gpio_init(RXRING_RTS);
+	gpio_set_dir(RXRING_RTS, GPIO_OUT);
+	gpio_put(RXRING_RTS, 0);
+#endif
+	irq_set_enabled(RXRING_IRQ, false);
+	while (Serial1.available())		// What came in before is kept
+		rxRing[rxHead++ & (SERIAL_RXRING - 1)] = Serial1.read();
+	core = irq_get_exclusive_handler(RXRING_IRQ);
+	if (core)
+		irq_remove_handler(RXRING_IRQ, core);
+	irq_set_exclusive_handler(RXRING_IRQ, _rx_irq);
+	uart_set_irq_enables(RXRING_UART, true, false);
+	irq_set_enabled(RXRING_IRQ, true);
+#ifdef SERIAL_TXRING
+	_tx_begin();
+#endif
+}
+
+#endif
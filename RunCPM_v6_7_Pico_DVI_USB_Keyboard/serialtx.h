@@ -0,0 +1,146 @@
+#ifndef SERIALTX_H
+#define SERIALTX_H
+
+/* Serial transmit ring, console output to Serial1 is queued and sent to the UART by an interrupt */
+/*===============================================================================*/
+// Writers only copy the bytes onto the ring, an interrupt moves them into the UART FIFO as it empties, so the
+// emulator and the display do not wait on the serial line unless the ring is full (see SERIAL_TXFULL)
+// With SERIAL_RXRING the UART interrupt is taken over from the core's SerialUART (see serialrx.h) and the FIFO is fed
+// from its transmit interrupt, which is only enabled while the ring holds bytes. Without it the interrupt stays
+// with the core, and a repeating timer feeds the FIFO instead
+// Both run on core 0 as the emulator does, the writer masks interrupts when it has to move the tail itself
+
+#include <hardware/uart.h>
+#include <hardware/sync.h>
+
+#if (SERIAL_TXRING & (SERIAL_TXRING - 1)) || SERIAL_TXRING < 256 || SERIAL_TXRING > 32768
+#error SERIAL_TXRING must be a power of two from 256 to 32768
+#endif
+
+#define TXRING_UART uart0		// UART behind Serial1
+#ifndef SERIAL_RXRING
+#define TXRING_TICK (16 * 10 * 1000000L / SERIALSPD)	// Microseconds between two refills of the 32 byte FIFO, the time
+														// 16 bytes take on the line, so it never runs dry (1.4 ms at 115200)
+#endif
+
+#define TXFULL_BLOCK 0			// Values of SERIAL_TXFULL
+#define TXFULL_DROPNEW 1
+#define TXFULL_DROPOLD 2
+
+static uint8 txRing[SERIAL_TXRING];
+static volatile uint16 txHead = 0;	// Next byte written, moved by the writer
+static volatile uint16 txTail = 0;	// Next byte sent, moved by the interrupt. Both count up forever
+#ifdef SERIAL_RXRING
+static volatile bool txActive = false;	// The transmit interrupt is enabled, it runs until the ring is empty
+#else
+static repeating_timer_t txTimer;
+#endif
+static bool txStarted = false;
+
+// Statistics, read by BDOS 231 (see host.h)
+static uint32 txDropped = 0;		// Bytes that never made it to the serial line
+static uint16 txHighWater = 0;		// Most bytes ever waiting on the ring
+
+// Moves bytes from the ring into the UART FIFO while it has room
+void __not_in_flash_func(_tx_fill)(void) {
+	uint16 tail = txTail;
+
+	while (tail != txHead && uart_is_writable(TXRING_UART)) {
+		uart_get_hw(TXRING_UART)->dr = txRing[tail & (SERIAL_TXRING - 1)];
+		++tail;
+	}
+	txTail = tail;
+}
+
+#ifdef SERIAL_RXRING
+// Called by the UART interrupt (see serialrx.h), turns the transmit interrupt off once the ring is empty
+void __not_in_flash_func(_tx_irq)(void) {
+	if (!txActive)
+		return;
+	_tx_fill();
+	if (txTail == txHead) {
+		hw_clear_bits(&uart_get_hw(TXRING_UART)->imsc, UART_UARTIMSC_TXIM_BITS);
+		txActive = false;
+	}
+}
+
+// Fills the FIFO and turns the transmit interrupt on if bytes are left. It only fires when the FIFO drains past
+// its trigger level, so it has to be started with a full FIFO. Called with interrupts masked
+static void _tx_kick(void) {
+	_tx_fill();
+	if (txTail != txHead) {
+		hw_set_bits(&uart_get_hw(TXRING_UART)->imsc, UART_UARTIMSC_TXIM_BITS);
+		txActive = true;
+	}
+}
+
+// Sends what was queued so far, called by _rx_begin() once the UART interrupt is ours
+void _tx_begin(void) {
+	uint32 irq = save_and_disable_interrupts();
+
+	txStarted = true;
+	_tx_kick();
+	restore_interrupts(irq);
+}
+#else
+bool _tx_callback(repeating_timer_t* rt) {
+	_tx_fill();
+	return(true);
+}
+#endif
+
+// Queues len bytes, a run at a time
+void _tx_write(const uint8* buf, uint16 len) {
+	uint32 irq;
+	uint16 head, room, n;
+
+#ifndef SERIAL_RXRING
+	if (!txStarted) {		// Serial1 is only set up once the first byte is written
+		add_repeating_timer_us(TXRING_TICK, _tx_callback, NULL, &txTimer);
+		txStarted = true;
+	}
+#endif
+	while (len) {
+		head = txHead;
+		room = SERIAL_TXRING - (uint16)(head - txTail);
+		if (!room) {
+#if SERIAL_TXFULL == TXFULL_DROPNEW
+			txDropped += len;
+			return;
+#elif SERIAL_TXFULL == TXFULL_DROPOLD
+			irq = save_and_disable_interrupts();
+			n = len < SERIAL_TXRING ? len : SERIAL_TXRING;
+			txTail += n;
+			txDropped += n;
+			restore_interrupts(irq);
+#else
+			irq = save_and_disable_interrupts();	// Sends what fits now instead of waiting for the next tick
+			_tx_fill();
+			restore_interrupts(irq);
+#endif
+			continue;
+		}
+		n = SERIAL_TXRING - (head & (SERIAL_TXRING - 1));	// Up to the end of the ring
+		if (n > room)
+			n = room;
+		if (n > len)
+			n = len;
+		memcpy(&txRing[head & (SERIAL_TXRING - 1)], buf, n);
+		__dmb();			// The bytes are stored before they are published
+		txHead = head + n;
+#ifdef SERIAL_RXRING
+		if (!txActive && txStarted) {	// The interrupt is idle, it has to be started
+			irq = save_and_disable_interrupts();
+			if (!txActive)
+				_tx_kick();
+			restore_interrupts(irq);
+		}
+#endif
+		buf += n;
+		len -= n;
+		if ((uint16)(txHead - txTail) > txHighWater)
+			txHighWater = txHead - txTail;
+	}
+}
+
+#endif
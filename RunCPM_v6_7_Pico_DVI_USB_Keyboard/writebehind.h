@@ -0,0 +1,169 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+/* Write behind, file writes are queued and committed to the card later on */
+/*===============================================================================*/
+// Writes to the file last written go to a queue, contiguous writes to the same file are merged into one entry
+// The queue is committed in order, as a whole, when it is full, when its oldest write is WRITEBEHIND_DELAY ms old,
+// when the console waits for input, and before anything else touches a queued file (read, open, close, delete,
+// rename, search), on BDOS flush, disk reset and warm boot
+// Core 1 runs the DVI output, so commits are done by core 0 at those points instead of by a worker on core 1
+// A write that fails when committed was already reported done to the program, so the file is kept and the failure
+// is returned by its next close, or by the next BDOS flush
+
+#define WB_ENTRIES 16		// Writes kept on the queue
+#define WB_BUCKETS 8		// Histogram buckets, powers of two
+
+typedef struct {
+	uint8 name[17];			// Host file name
+	uint32 fpos;			// Position of the first byte
+	uint16 start;			// Offset of its data on wbData
+	uint16 len;				// Number of bytes
+} WB_ENTRY;
+
+static WB_ENTRY wbQueue[WB_ENTRIES];
+static uint8 wbData[WRITEBEHIND_SIZE];
+static uint8 wbCount = 0;			// Entries on the queue
+static uint16 wbUsed = 0;			// Bytes used on wbData
+static uint32 wbOldest;				// millis() of the oldest queued write
+static uint8 wbKnown[17] = { 0 };	// Last file written, only writes to a file known to exist are queued
+static uint8 wbFailed[17] = { 0 };	// Last file a commit failed to write, until the program is told
+
+// Statistics, read by BDOS 231 (see host.h)
+static uint16 wbDepthHist[WB_BUCKETS];		// Entries on the queue at each commit: 1, 2-3, 4-7, 8-15, 16-31...
+static uint16 wbLatencyHist[WB_BUCKETS];	// Milliseconds taken by each commit: 0, 1, 2-3, 4-7, 8-15...
+static uint16 wbCommits = 0;
+static uint16 wbErrors = 0;					// Writes that failed when committed
+
+uint8 _wb_bucket(uint32 n) {
+	uint8 b = 0;
+
+	while (n > 1 && b < WB_BUCKETS - 1) {
+		n >>= 1;
+		++b;
+	}
+	return(b);
+}
+
+// Commits the whole queue, in order, returns false if a write failed
+bool _wb_drain(void) {
+	WB_ENTRY* e;
+	File32 f;
+	uint32 start;
+	uint8 i, lat;
+	bool result = true;
+
+	if (!wbCount)
+		return(true);
+	start = millis();
+	digitalWrite(LED, HIGH ^ LEDinv);
+	for (i = 0; i < wbCount; ++i) {
+		e = &wbQueue[i];
+		if (!i || strcmp((char*)e->name, (char*)wbQueue[i - 1].name)) {	// Keeps the file open for runs of writes to it
+			if (f)
+				f.close();
+			f = _sys_open(e->name, O_RDWR);
+		}
+		if (f && e->fpos > f.size()) {	// Fills the gap with zeros, as writing past the end of the file does
+			f.seek(f.size());
+			while (f.size() < e->fpos && f.write((uint8)0) == 1);
+		}
+		if (!f || !f.seek(e->fpos) || f.write(&wbData[e->start], e->len) != e->len) {
+			++wbErrors;
+			strcpy((char*)wbFailed, (char*)e->name);
+			result = false;
+		}
+		_sys_dirchanged(e->name);
+	}
+	if (f)
+		f.close();
+	digitalWrite(LED, LOW ^ LEDinv);
+	++wbDepthHist[_wb_bucket(wbCount)];
+	lat = millis() - start ? _wb_bucket(millis() - start) + 1 : 0;
+	++wbLatencyHist[lat < WB_BUCKETS ? lat : WB_BUCKETS - 1];
+	++wbCommits;
+	wbCount = 0;
+	wbUsed = 0;
+	return(result);
+}
+
+// Commits the queue if it holds writes to filename, and forgets filename if it is going away (forget)
+// Returns false if writes to filename failed, now or in an earlier commit, and the program was not told yet
+bool _wb_barrier(uint8* filename, bool forget) {
+	uint8 i;
+	bool result;
+
+	for (i = 0; i < wbCount; ++i) {
+		if (!strcmp((char*)wbQueue[i].name, (char*)filename)) {
+			_wb_drain();
+			break;
+		}
+	}
+	result = strcmp((char*)wbFailed, (char*)filename) != 0;
+	if (forget) {
+		if (!result)
+			wbFailed[0] = 0;	// Nothing left to tell about
+		if (!strcmp((char*)wbKnown, (char*)filename))
+			wbKnown[0] = 0;
+	}
+	return(result);
+}
+
+// Commits the queue before filename is closed, returns false once if writes to it failed
+bool _wb_close(uint8* filename) {
+	bool result = _wb_barrier(filename, false);
+
+	if (!result)
+		wbFailed[0] = 0;
+	return(result);
+}
+
+// Commits the whole queue on BDOS flush, returns false once if a write failed since the last close or flush
+bool _wb_flush(void) {
+	bool result = _wb_drain() && !wbFailed[0];
+
+	wbFailed[0] = 0;
+	return(result);
+}
+
+// Commits the queue once its oldest write is old enough, or at once if the console is waiting for input
+void _wb_idle(bool waiting) {
+	if (wbCount && (waiting || millis() - wbOldest >= WRITEBEHIND_DELAY))
+		_wb_drain();
+}
+
+// Queues *recs records from the DMA buffer, returns false if the write has to be done right away
+bool _wb_write(uint8* filename, long fpos, uint8* recs) {
+	WB_ENTRY* e = &wbQueue[wbCount ? wbCount - 1 : 0];
+	uint16 len = *recs * BlkSZ;
+	bool merge;
+
+	if (strcmp((char*)wbKnown, (char*)filename) || len > WRITEBEHIND_SIZE)
+		return(false);
+	merge = wbCount && !strcmp((char*)e->name, (char*)filename) && e->fpos + e->len == (uint32)fpos;
+	if (wbUsed + len > WRITEBEHIND_SIZE || (!merge && wbCount == WB_ENTRIES)) {
+		_wb_drain();
+		merge = false;
+	}
+	if (!wbCount)
+		wbOldest = millis();
+	if (merge) {
+		e->len += len;		// Continues the previous write
+	} else {
+		e = &wbQueue[wbCount++];
+		strcpy((char*)e->name, (char*)filename);
+		e->fpos = fpos;
+		e->start = wbUsed;
+		e->len = len;
+	}
+	memcpy(&wbData[wbUsed], _RamSysAddr(dmaAddr), len);
+	wbUsed += len;
+	return(true);
+}
+
+// Remembers a file that was just written to, so the next writes to it can be queued
+void _wb_written(uint8* filename) {
+	strcpy((char*)wbKnown, (char*)filename);
+}
+
+#endif
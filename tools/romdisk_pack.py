@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Packs a folder laid out like a RunCPM drive into a ROM drive image.
+
+The folder holds one subfolder per user (0 to F), as on the card. The image
+is written as is, to be copied to the card root as ROMDISK.IMG, and optionally
+as a C header (romdisk_image.h) to be linked into flash with ROMDISK_FLASH.
+See romdisk.h for the image layout.
+
+usage: romdisk_pack.py FOLDER IMAGE [--header romdisk_image.h]
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+BLOCK = 1024        # Block size, must not exceed RO_MAXBLOCK
+WINDOW = 4096       # Largest match distance
+MINLEN = 3
+MAXLEN = 18
+
+
+def fcbname(name):
+    """Turns NAME.EXT into the 11 byte FCB form, None if it does not fit."""
+    base, dot, ext = name.upper().partition('.')
+    if not base or len(base) > 8 or len(ext) > 3 or '.' in ext:
+        return None
+    return (base.ljust(8) + ext.ljust(3)).encode('ascii')
+
+
+def lzss(data):
+    """Compresses a block, in the format unpacked by _ro_unpack."""
+    out = bytearray()
+    heads = {}
+    i = 0
+    while i < len(data):
+        flagpos = len(out)
+        out.append(0)
+        flags = 0
+        for bit in range(8):
+            if i >= len(data):
+                break
+            best, dist = 0, 0
+            key = bytes(data[i:i + MINLEN])
+            for j in reversed(heads.get(key, [])):
+                if i - j > WINDOW:
+                    break
+                n = 0
+                while n < MAXLEN and i + n < len(data) and data[j + n] == data[i + n]:
+                    n += 1
+                if n > best:
+                    best, dist = n, i - j
+                    if n == MAXLEN:
+                        break
+            if best >= MINLEN:
+                out.append((dist - 1) & 0xff)
+                out.append(((dist - 1) >> 8) | ((best - MINLEN) << 4))
+                step = best
+            else:
+                flags |= 1 << bit
+                out.append(data[i])
+                step = 1
+            for k in range(i, i + step):
+                heads.setdefault(bytes(data[k:k + MINLEN]), []).append(k)
+            i += step
+        out[flagpos] = flags
+    return bytes(out)
+
+
+def collect(folder):
+    files = []
+    for user in range(16):
+        path = os.path.join(folder, '%X' % user)
+        if not os.path.isdir(path):
+            continue
+        for name in sorted(os.listdir(path)):
+            full = os.path.join(path, name)
+            if not os.path.isfile(full):
+                continue
+            fcb = fcbname(name)
+            if fcb is None:
+                print('skipping %s, not a CP/M name' % full, file=sys.stderr)
+                continue
+            with open(full, 'rb') as f:
+                files.append((user, fcb, f.read()))
+    return files
+
+
+def pack(files):
+    entries = bytearray()
+    blocks = []
+    for user, fcb, data in files:
+        entries += struct.pack('<B11sIHH', user, fcb, len(data), len(blocks), 0)
+        for pos in range(0, len(data), BLOCK):
+            raw = data[pos:pos + BLOCK]
+            packed = lzss(raw)
+            blocks.append(packed if len(packed) < len(raw) else raw)
+    if len(files) > 0xffff or len(blocks) > 0xffff:
+        raise SystemExit('too many files or blocks for an image')
+    header = b'RCPMROM1' + struct.pack('<HHHH', len(files), len(blocks), BLOCK, 0)
+    offset = len(header) + len(entries) + 4 * (len(blocks) + 1)
+    table = bytearray()
+    for b in blocks:
+        table += struct.pack('<I', offset)
+        offset += len(b)
+    table += struct.pack('<I', offset)
+    return header + bytes(entries) + bytes(table) + b''.join(blocks)
+
+
+def header(image, path):
+    with open(path, 'w') as f:
+        f.write('// Generated by tools/romdisk_pack.py, do not edit\n')
+        f.write('static const uint8 romdiskImage[%d] = {\n' % len(image))
+        for pos in range(0, len(image), 16):
+            f.write('\t' + ', '.join('0x%02x' % b for b in image[pos:pos + 16]) + ',\n')
+        f.write('};\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Packs a RunCPM drive folder into a ROM drive image.')
+    parser.add_argument('folder', help='drive folder, with user subfolders 0 to F')
+    parser.add_argument('image', help='image file to write')
+    parser.add_argument('--header', help='also write the image as a C header, for ROMDISK_FLASH')
+    args = parser.parse_args()
+
+    files = collect(args.folder)
+    image = pack(files)
+    with open(args.image, 'wb') as f:
+        f.write(image)
+    if args.header:
+        header(image, args.header)
+    total = sum(len(d) for _, _, d in files)
+    print('%d files, %d bytes packed into %d' % (len(files), total, len(image)))
+
+
+if __name__ == '__main__':
+    main()